@@ -1,8 +1,17 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
 #include <sstream>
 #include <iostream>
 #include <fstream>
@@ -10,33 +19,529 @@
 #include <queue>
 #include <stack>
 #include <map>
+#include <deque>
+#include <set>
 #include <list>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#include "mmu.h"
 
 using namespace std;
+
+// Everything but the engine API of mmu.h stays private to this file, for the programs linking libmmu.a
+namespace {
+
 //-------------------- STEP 0 : Define the constant of the problem --------------------
-int MAX_NUM_FRAMES; // Max number of frames in memory. Will be set when reading the arguments
-const int MAX_NUM_PTE = 64; // Max number of PTE for each process. Will be set when reading the arguments
-
-// Total cost output variable
-unsigned long inst_count;
-unsigned long ctx_switches;
-unsigned long process_exits;
-unsigned long cost;
-
-// Cost constants
-const int COST_READ = 1;
-const int COST_WRITE = 1;
-const int COST_CTX_SWITCH = 130;
-const int COST_EXIT = 1250;
-const int COST_MAP = 300;
-const int COST_UNMAP = 400;
-const int COST_IN = 3100;
-const int COST_OUT = 2700;
-const int COST_FIN = 2800;
-const int COST_FOUT = 2400;
-const int COST_ZERO = 140;
-const int COST_SEGV = 340;
-const int COST_SEGPROT = 420;
+int MAX_NUM_PTE = 64; // Number of virtual pages of each process. Can be changed with the -v argument
+
+// Limits of the simulation : the frame number must fit in PTE::physAddr
+const int MAX_FRAMES_LIMIT = 1 << 24;
+const int MAX_PTE_LIMIT = 1 << 30;
+
+// The costs of the operations (MmuCostTable) are set per simulation, the defaults are in mmu.h
+
+// Bounded lock-free queue between one producer thread and one consumer thread, used by the pipelined mode (-p).
+// The slots stay in the ring : the producer fills the slot of acquire() in place and hands it over with publish(),
+// the consumer reads the slot of front() and gives it back with pop(), so nothing is copied nor allocated.
+// Each side only writes its own index, the other one reads it with acquire/release ordering
+template <class T>
+struct SpscRing {
+
+    static const int SPIN_LIMIT = 128; // busy waits before we let the other threads run
+
+    vector<T> slots;
+    size_t mask; // the capacity is a power of 2
+    char pad0[64];
+    atomic<size_t> head; // next slot to consume, only written by the consumer
+    char pad1[64];
+    atomic<size_t> tail; // next slot to produce, only written by the producer
+    char pad2[64];
+    atomic<bool> closed; // the producer won't publish anything anymore
+    atomic<bool> cancelled; // the consumer stopped, the producer must give up
+
+    SpscRing(int capacity) : slots(capacity), head(0), tail(0), closed(false), cancelled(false) {
+        mask = capacity - 1;
+    }
+
+    static void wait(int& spins) {
+        if (++spins > SPIN_LIMIT) {
+            this_thread::yield();
+        }
+    }
+
+    // Producer : free slot to fill, 0 if the consumer cancelled
+    T* acquire() {
+        size_t t = tail.load(memory_order_relaxed);
+        int spins = 0;
+        while (t - head.load(memory_order_acquire) == slots.size()) {
+            if (cancelled.load(memory_order_acquire)) {
+                return 0;
+            }
+            wait(spins);
+        }
+        return &slots[t & mask];
+    }
+
+    void publish() {
+        tail.store(tail.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+
+    void close() {
+        closed.store(true, memory_order_release);
+    }
+
+    // Consumer : oldest published slot, 0 once the ring is closed and empty
+    T* front() {
+        size_t h = head.load(memory_order_relaxed);
+        int spins = 0;
+        while (h == tail.load(memory_order_acquire)) {
+            if (closed.load(memory_order_acquire)) {
+                // everything published before close() is visible now
+                if (h == tail.load(memory_order_acquire)) {
+                    return 0;
+                }
+                break;
+            }
+            wait(spins);
+        }
+        return &slots[h & mask];
+    }
+
+    void pop() {
+        head.store(head.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+
+    void cancel() {
+        cancelled.store(true, memory_order_release);
+    }
+
+    bool empty() {
+        return head.load(memory_order_acquire) == tail.load(memory_order_acquire);
+    }
+
+};
+
+// Last stage of the pipelined mode (-p3) : full output buffers are written to the file by a thread of its own,
+// so the simulation never waits for the disk or the terminal
+struct OutputWriter {
+
+    static const int NUM_CHUNKS = 4;
+
+    struct Chunk {
+        char* data;
+        int size;
+    };
+
+    FILE* file;
+    SpscRing<Chunk> chunks;
+    thread writer_thread;
+
+    OutputWriter(FILE* file_, int chunk_size) : chunks(NUM_CHUNKS) {
+        file = file_;
+        for (int i = 0; i < NUM_CHUNKS; i++) {
+            chunks.slots[i].data = new char[chunk_size];
+            chunks.slots[i].size = 0;
+        }
+        writer_thread = thread(&OutputWriter::write_chunks, this);
+    }
+
+    ~OutputWriter() {
+        chunks.close();
+        writer_thread.join();
+        for (int i = 0; i < NUM_CHUNKS; i++) {
+            delete[] chunks.slots[i].data;
+        }
+    }
+
+    void write_chunks() {
+        Chunk* chunk;
+        while ((chunk = chunks.front()) != 0) {
+            fwrite(chunk->data, 1, chunk->size, file);
+            chunks.pop();
+        }
+        fflush(file);
+    }
+
+    // Buffer to fill next
+    char* next_buffer() {
+        return chunks.acquire()->data;
+    }
+
+    // Give the buffer of next_buffer() to the writer
+    void submit(int size) {
+        chunks.acquire()->size = size;
+        chunks.publish();
+    }
+
+    // Wait until everything submitted is in the file
+    void drain() {
+        int spins = 0;
+        while (!chunks.empty()) {
+            SpscRing<Chunk>::wait(spins);
+        }
+        fflush(file);
+    }
+
+};
+
+// Buffered output sink. Everything printed by the simulator goes through it so that the per-event trace
+// costs a few byte copies instead of a printf call, and is written to its file in large blocks.
+// Without file everything is dropped
+struct OutputBuffer {
+
+    static const int BUFFER_SIZE = 1 << 20;
+    static const int MAX_ITEM_SIZE = 64; // biggest item written at once (a number, a short label ...)
+
+    char* buffer; // buffer being filled : our own one, or one of the writer
+    char* own_buffer;
+    int pos; // number of bytes waiting in the buffer
+    FILE* file; // where the buffer is flushed
+    OutputWriter* writer; // 0 unless the buffers are written by another thread (start_writer)
+
+    OutputBuffer(FILE* file_) {
+        buffer = own_buffer = new char[BUFFER_SIZE];
+        pos = 0;
+        file = file_;
+        writer = 0;
+    }
+
+    ~OutputBuffer() {
+        flush();
+        delete writer;
+        delete[] own_buffer;
+    }
+
+    // From now on the full buffers are written by a writer thread
+    void start_writer() {
+        if (file == 0 || writer != 0) {
+            return;
+        }
+        flush();
+        writer = new OutputWriter(file, BUFFER_SIZE);
+        buffer = writer->next_buffer();
+    }
+
+    // Send the buffer to the file, or to the writer thread which gives us another one
+    void write_out() {
+        if (writer != 0) {
+            writer->submit(pos);
+            buffer = writer->next_buffer();
+        } else if (file != 0) {
+            fwrite(buffer, 1, pos, file);
+        }
+        pos = 0;
+    }
+
+    void flush() {
+        if (file == 0) {
+            pos = 0;
+            return;
+        }
+        if (pos > 0) {
+            write_out();
+        }
+        if (writer != 0) {
+            writer->drain();
+        } else {
+            fflush(file);
+        }
+    }
+
+    // Make sure we can write an item of MAX_ITEM_SIZE bytes
+    void reserve() {
+        if (pos > BUFFER_SIZE - MAX_ITEM_SIZE) {
+            write_out();
+        }
+    }
+
+    void put(char c) {
+        reserve();
+        buffer[pos++] = c;
+    }
+
+    void put(const char* str) {
+        while (*str) {
+            reserve();
+            while (*str && pos < BUFFER_SIZE) {
+                buffer[pos++] = *str++;
+            }
+        }
+    }
+
+    // Fast integer formatting : digits are written backwards in a small scratch array
+    void put(unsigned long value) {
+        reserve();
+        char digits[24];
+        int num_digits = 0;
+        do {
+            digits[num_digits++] = (char) ('0' + value % 10);
+            value /= 10;
+        } while (value != 0);
+        while (num_digits > 0) {
+            buffer[pos++] = digits[--num_digits];
+        }
+    }
+
+    void put(long value) {
+        if (value < 0) {
+            put('-');
+            put((unsigned long) (-(value + 1)) + 1);
+        } else {
+            put((unsigned long) value);
+        }
+    }
+
+    void put(int value) {
+        put((long) value);
+    }
+
+    // Helpers for the trace events : " NAME\n", " NAME a\n" and " NAME a:b\n"
+    void event(const char* name) {
+        put(' '); put(name); put('\n');
+    }
+
+    void event(const char* name, int a) {
+        put(' '); put(name); put(' '); put(a); put('\n');
+    }
+
+    void event(const char* name, int a, int b) {
+        put(' '); put(name); put(' '); put(a); put(':'); put(b); put('\n');
+    }
+
+};
+
+
+struct Process;
+struct Frame;
+struct TLB;
+
+// Time model (-d) : an I/O device of the simulated machine, the swap area or the file device. Up to depth
+// requests are in service at the same time, each one waits for its latency and then for its turn on the
+// channel, which transfers one page at a time in transfer_time. Requests are submitted in time order
+struct IoDevice {
+    vector<unsigned long> slot_free; // time each slot of the queue is free again
+    unsigned long channel_free; // time the channel is done with the transfers it has
+    unsigned long transfer_time;
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long wait_time; // time spent by the requests waiting for a slot
+    unsigned long busy_time; // time with at least one request in service
+    unsigned long last_complete;
+
+    IoDevice() {
+        transfer_time = 0;
+        reset(1);
+    }
+
+    void reset(int depth) {
+        slot_free.assign(depth, 0);
+        channel_free = 0;
+        reads = 0;
+        writes = 0;
+        wait_time = 0;
+        busy_time = 0;
+        last_complete = 0;
+    }
+
+    // Submit a request at time arrival, returns the time it completes
+    unsigned long submit(unsigned long arrival, unsigned long latency, bool write) {
+        if (write) {
+            writes++;
+        } else {
+            reads++;
+        }
+        // The slots are freed in completion order and the arrivals don't go back in time, so the requests
+        // start and complete in order : the busy time is the union of [start, complete] computed on the fly
+        vector<unsigned long>::iterator slot = min_element(slot_free.begin(), slot_free.end());
+        unsigned long start = max(arrival, *slot);
+        unsigned long complete = max(start + latency, channel_free) + transfer_time;
+        wait_time += start - arrival;
+        busy_time += complete - max(start, last_complete);
+        channel_free = complete;
+        last_complete = complete;
+        *slot = complete;
+        return complete;
+    }
+};
+
+// Time model (-d) : the clock of the CPU with the swap and file devices. Every operation but IN, OUT, FIN,
+// FOUT and the prefetches is CPU work and moves the clock. These are requests on the devices instead : a
+// fault waits for the read of its page, the process is blocked until then and the next process can run
+// after a context switch, while the writebacks of dirty pages complete in the background
+struct TimeModel {
+    IoDevice swap;
+    IoDevice file;
+    int depth;
+    unsigned long clock;
+    unsigned long cpu_time; // time the CPU spent on instructions
+    unsigned long idle_time; // time the CPU waited for a blocked process
+    vector<unsigned long> fault_latencies; // from the start of each faulting instruction to its page read
+
+    // The instruction being simulated
+    Process* process; // the process it runs for, 0 for a context switch
+    unsigned long start; // clock when it started
+    unsigned long start_cost; // sim->cost when it started
+    unsigned long io_cost; // part of the cost since then done by the devices
+    unsigned long ready; // when its blocking reads complete, 0 if none
+    bool faulted;
+
+    TimeModel(int depth_, unsigned long transfer_time) {
+        depth = depth_;
+        swap.transfer_time = transfer_time;
+        file.transfer_time = transfer_time;
+        reset();
+    }
+
+    void reset() {
+        swap.reset(depth);
+        file.reset(depth);
+        clock = 0;
+        cpu_time = 0;
+        idle_time = 0;
+        fault_latencies.clear();
+        process = 0;
+        start = 0;
+        start_cost = 0;
+        io_cost = 0;
+        ready = 0;
+        faulted = false;
+    }
+
+    // A request of the current instruction, submitted once the CPU work it did so far. cost is sim->cost with
+    // the latency of the request already charged. Returns its completion
+    unsigned long io(IoDevice& device, int latency, bool write, unsigned long cost) {
+        unsigned long arrival = clock + (cost - latency - start_cost - io_cost);
+        io_cost += latency;
+        return device.submit(arrival, latency, write);
+    }
+
+    // The instruction can't complete before time
+    void block(unsigned long time) {
+        ready = max(ready, time);
+    }
+
+    // End of the simulation : the CPU and the devices are done
+    unsigned long total_time() const {
+        return max(clock, max(swap.last_complete, file.last_complete));
+    }
+
+    // p-th percentile of the fault latencies, once sorted
+    unsigned long latency_percentile(int p) const {
+        if (fault_latencies.empty()) {
+            return 0;
+        }
+        return fault_latencies[(fault_latencies.size() - 1) * p / 100];
+    }
+};
+
+// State of one simulation : its frame count, counters, output, process pool, frame table, free pool and TLB.
+// The code reaches the running simulation through sim, which is per thread, so the sweep mode (-S) can run
+// one simulation on each worker thread. The settings above are shared : they don't change once we started
+struct Simulation {
+
+    int MAX_NUM_FRAMES; // Max number of frames in memory
+    int NUM_PROCESSES;
+
+    // Total cost output variables
+    unsigned long inst_count;
+    unsigned long ctx_switches;
+    unsigned long process_exits;
+    unsigned long cost;
+
+    // Page table statistics
+    unsigned long pt_walks; // number of translations walking the page table
+    unsigned long pt_walk_reads; // number of tables read by these walks
+
+    // TLB statistics
+    unsigned long tlb_hits;
+    unsigned long tlb_misses;
+    unsigned long tlb_flushes;
+    unsigned long tlb_invalidations;
+    TLB* tlb; // 0 if no TLB is simulated, owned by the simulation
+
+    vector<Process> processes;
+    vector<Frame> frameTable;
+    // Free Frame pool : FIFO list of frame ids linked through Frame::next_free, no Frame is ever copied
+    int frameFreePoolHead; // first frame to allocate
+    int frameFreePoolTail; // last frame released
+    int numFreeFrames; // frames in the free pool
+
+    // Reclaim daemon (-k) : woken up below RECLAIM_LOW free frames, it evicts until RECLAIM_HIGH. 0 if disabled
+    int RECLAIM_LOW;
+    int RECLAIM_HIGH;
+    unsigned long kswapd_wakeups;
+    unsigned long pages_reclaimed; // pages evicted by the daemon
+    unsigned long direct_reclaims; // pages evicted by the faults themselves, the free pool being empty
+    unsigned long reclaim_cost; // cost of the daemon, not in cost
+
+    // Readahead (-r) : at most READAHEAD_MAX pages are prefetched after a sequential fault, 0 if disabled
+    int READAHEAD_MAX;
+    unsigned long readahead_batches;
+    unsigned long readahead_pages; // pages prefetched
+    unsigned long readahead_hits; // prefetched pages accessed
+    unsigned long readahead_wasted; // prefetched pages unmapped without being accessed
+
+    TimeModel* time; // time model (-d), 0 if disabled, owned by the simulation
+
+    OutputBuffer output;
+    // Output options : -oO enables the per-instruction trace, the others the final tables/summary
+    bool OUTPUT_OPS;
+    bool OUTPUT_PAGETABLES;
+    bool OUTPUT_FRAMETABLE;
+    bool OUTPUT_SUMMARY;
+    bool OUTPUT_OPT_RATIO;
+
+    MmuCostTable costs;
+    int WORKING_SET_TAU; // Age from which a frame leaves the working set
+    int NUM_CPUS; // SMP mode (-s) when more than 1
+    vector<MmuCpuResults> cpus; // SMP mode : statistics of each simulated CPU
+
+    Simulation(int num_frames, FILE* output_file) : output(output_file) {
+        MAX_NUM_FRAMES = num_frames;
+        OUTPUT_OPS = false;
+        OUTPUT_PAGETABLES = false;
+        OUTPUT_FRAMETABLE = false;
+        OUTPUT_SUMMARY = false;
+        OUTPUT_OPT_RATIO = false;
+        WORKING_SET_TAU = 49;
+        NUM_CPUS = 1;
+        NUM_PROCESSES = -1;
+        inst_count = 0;
+        ctx_switches = 0;
+        process_exits = 0;
+        cost = 0;
+        pt_walks = 0;
+        pt_walk_reads = 0;
+        tlb_hits = 0;
+        tlb_misses = 0;
+        tlb_flushes = 0;
+        tlb_invalidations = 0;
+        tlb = 0;
+        frameFreePoolHead = -1;
+        frameFreePoolTail = -1;
+        numFreeFrames = 0;
+        RECLAIM_LOW = 0;
+        RECLAIM_HIGH = 0;
+        kswapd_wakeups = 0;
+        pages_reclaimed = 0;
+        direct_reclaims = 0;
+        reclaim_cost = 0;
+        READAHEAD_MAX = 0;
+        readahead_batches = 0;
+        readahead_pages = 0;
+        readahead_hits = 0;
+        readahead_wasted = 0;
+        time = 0;
+    }
+
+    ~Simulation(); // once the frames are defined
+
+};
+
+thread_local Simulation* sim = 0; // simulation run by the current thread
 
 //-------------------- STEP 1 : Create Virtual Memory Area objects --------------------
 // First, we write the Virtual Memory Area object because we will need it to build the Process objects
@@ -48,12 +553,20 @@ struct VMA {
     bool write_protected; // bit if VMA is write protected
     bool file_mapped; // bit if VMA is mapped to a file
 
+    // Readahead (-r) : detection of the sequential faults in the VMA
+    int ra_next; // page following the last fault or readahead of the stream, -1 before the first fault
+    int ra_window; // pages of the last readahead of the stream, 0 while the faults aren't sequential
+    int ra_marker; // prefetched page whose first access starts the next readahead, -1 if none
+
     VMA (int vmaid_, int start_page_, int end_page_, bool write_protected_, bool file_mapped_) {
         vmaid = vmaid_;
         start_page = start_page_;
         end_page = end_page_;
         write_protected = write_protected_;
         file_mapped = file_mapped_;
+        ra_next = -1;
+        ra_window = 0;
+        ra_marker = -1;
     }
 };
 
@@ -64,9 +577,12 @@ struct PTE {
     unsigned int modified:1;
     unsigned int write_protect:1;
     unsigned int pagedout:1;
-    unsigned int physAddr:7;
+    unsigned int physAddr:24; // up to MAX_FRAMES_LIMIT frames
     
-    // Added info
+    // Added info : copy of the VMA the page belongs to, set when the page table leaf holding the PTE
+    // is allocated so the fault path never has to search the VMA list
+    unsigned int in_vma:1;
+    unsigned int file_mapped:1;
 
     // We initialize the PTE as empty before the simulation
     PTE () {
@@ -76,75 +592,489 @@ struct PTE {
         write_protect = 0;
         pagedout = 0;
         physAddr = 0;
+        in_vma = 0;
+        file_mapped = 0;
+    }
+
+};
+
+// Page table of a process : a radix tree of PT_LEVELS levels. Level 0 is the top table, the last level
+// holds the PTEs. The tables are only allocated when one of their pages is touched, so the memory used
+// by a page table follows the pages actually used and not the size of the virtual address space.
+// By default it's a 2 levels table with leaves of 512 PTEs and the walk is free, like the flat table
+// of the original simulator. Past 2^20 pages the top table would take megabytes in every process, so the
+// pages above the leaves are split evenly between up to 3 levels of at most 512 entries. With -l<levels>
+// the virtual page number is split evenly between the levels and each table read by a walk and each table
+// allocation is added to the cost
+const int PT_MAX_LEVELS = 4;
+const int PT_DEFAULT_LEAF_BITS = 9;
+const int PT_DEFAULT_TWO_LEVELS_BITS = 20; // biggest address space of the default 2 levels geometry
+const int PT_MAX_TABLE_BITS = 16; // -l can't give tables of more than 2^16 entries
+// They start with the default geometry for 64 pages, init_pagetable_geometry(0)
+int PT_LEVELS = 2; // number of levels of the page tables
+int PT_LEVEL_BITS[PT_MAX_LEVELS] = {0, PT_DEFAULT_LEAF_BITS}; // number of bits of the virtual page indexing each level
+int PT_LEVEL_SHIFT[PT_MAX_LEVELS] = {PT_DEFAULT_LEAF_BITS, 0}; // position of these bits in the virtual page
+int PT_LEAF_SIZE = 1 << PT_DEFAULT_LEAF_BITS; // number of PTEs in a leaf
+bool PT_COSTS = false; // true if the walks and allocations are accounted (-l option)
+int COST_PT_WALK = 1; // cost of reading one table during a walk, like a memory read
+int COST_PT_ALLOC = 140; // cost of allocating one table, like zeroing a page
+
+// Number of bits of the virtual page numbers of an address space of num_vpages pages
+int vpage_bits(int num_vpages) {
+    int vbits = 0;
+    while ((1L << vbits) < num_vpages) {
+        vbits++;
+    }
+    return vbits;
+}
+
+// Fewest levels an evenly split page table of num_vpages pages can have without a table above 2^PT_MAX_TABLE_BITS
+int pagetable_min_levels(int num_vpages) {
+    return max((vpage_bits(num_vpages) + PT_MAX_TABLE_BITS - 1) / PT_MAX_TABLE_BITS, 1);
+}
+
+// Split the virtual page number between the levels once we know the size of the address spaces.
+// levels = 0 for the default geometry
+void init_pagetable_geometry(int levels) {
+    int vbits = vpage_bits(MAX_NUM_PTE);
+    if (levels > 0) {
+        // Lower levels get ceil(vbits / levels) bits, the top one the rest
+        PT_LEVELS = levels;
+        int bits = (vbits + levels - 1) / levels;
+        for (int level = PT_LEVELS - 1; level >= 0; level--) {
+            PT_LEVEL_BITS[level] = min(bits, vbits);
+            vbits -= PT_LEVEL_BITS[level];
+        }
+    } else {
+        // Default geometry : leaves of 512 PTEs and one top table for the rest, or up to 3 even levels
+        int upper_bits = max(vbits - PT_DEFAULT_LEAF_BITS, 0);
+        int upper_levels = 1;
+        if (vbits > PT_DEFAULT_TWO_LEVELS_BITS) {
+            upper_levels = min((upper_bits + PT_DEFAULT_LEAF_BITS - 1) / PT_DEFAULT_LEAF_BITS, PT_MAX_LEVELS - 1);
+        }
+        PT_LEVELS = upper_levels + 1;
+        PT_LEVEL_BITS[PT_LEVELS - 1] = PT_DEFAULT_LEAF_BITS;
+        int bits = (upper_bits + upper_levels - 1) / upper_levels;
+        for (int level = PT_LEVELS - 2; level >= 0; level--) {
+            PT_LEVEL_BITS[level] = min(bits, upper_bits);
+            upper_bits -= PT_LEVEL_BITS[level];
+        }
+    }
+    int shift = 0;
+    for (int level = PT_LEVELS - 1; level >= 0; level--) {
+        PT_LEVEL_SHIFT[level] = shift;
+        shift += PT_LEVEL_BITS[level];
+    }
+    PT_LEAF_SIZE = 1 << PT_LEVEL_BITS[PT_LEVELS - 1];
+}
+
+struct PageTable {
+
+    void* root; // top table : array of child tables, or of PTEs for a 1 level page table
+    int num_tables; // number of tables allocated in this page table
+
+    PageTable() {
+        num_tables = 0;
+        root = allocate_table(0);
+    }
+
+    PageTable(const PageTable& other) {
+        num_tables = 0;
+        root = copy_table(other.root, 0);
+    }
+
+    PageTable& operator=(const PageTable& other) {
+        if (this != &other) {
+            PageTable tmp(other);
+            swap(root, tmp.root);
+            swap(num_tables, tmp.num_tables);
+        }
+        return *this;
+    }
+
+    ~PageTable() {
+        free_table(root, 0);
+    }
+
+    static int table_size(int level) {
+        return 1 << PT_LEVEL_BITS[level];
+    }
+
+    static int index(int vpage, int level) {
+        return (vpage >> PT_LEVEL_SHIFT[level]) & (table_size(level) - 1);
+    }
+
+    void* allocate_table(int level) {
+        num_tables++;
+        if (level == PT_LEVELS - 1) {
+            return new PTE[table_size(level)];
+        }
+        return new void*[table_size(level)]();
+    }
+
+    void free_table(void* table, int level) {
+        if (level == PT_LEVELS - 1) {
+            delete[] (PTE*) table;
+            return;
+        }
+        void** children = (void**) table;
+        for (int i = 0; i < table_size(level); i++) {
+            if (children[i] != 0) {
+                free_table(children[i], level + 1);
+            }
+        }
+        delete[] children;
+    }
+
+    void* copy_table(void* table, int level) {
+        void* new_table = allocate_table(level);
+        if (level == PT_LEVELS - 1) {
+            copy((PTE*) table, (PTE*) table + table_size(level), (PTE*) new_table);
+            return new_table;
+        }
+        for (int i = 0; i < table_size(level); i++) {
+            void* child = ((void**) table)[i];
+            if (child != 0) {
+                ((void**) new_table)[i] = copy_table(child, level + 1);
+            }
+        }
+        return new_table;
+    }
+
+    PTE* find_leaf(int vpage) const {
+        int tables_read;
+        return find_leaf(vpage, tables_read);
+    }
+
+    // Leaf holding vpage, 0 if not allocated. Never allocates.
+    // tables_read is set to the number of tables read, like a hardware walk would do
+    PTE* find_leaf(int vpage, int& tables_read) const {
+        void* table = root;
+        tables_read = 1;
+        for (int level = 0; level < PT_LEVELS - 1; level++) {
+            table = ((void**) table)[index(vpage, level)];
+            if (table == 0) {
+                return 0;
+            }
+            tables_read++;
+        }
+        return (PTE*) table;
+    }
+
+    // PTE of vpage if its leaf exists, 0 otherwise. Never allocates
+    PTE* find(int vpage) const {
+        int tables_read;
+        PTE* leaf = find_leaf(vpage, tables_read);
+        return (leaf == 0) ? 0 : &leaf[index(vpage, PT_LEVELS - 1)];
+    }
+
+    // Leaf holding vpage, allocating the missing tables on the way.
+    // new_leaf is set to true if the leaf itself was allocated
+    PTE* get_leaf(int vpage, bool& new_leaf) {
+        new_leaf = false;
+        void* table = root;
+        for (int level = 0; level < PT_LEVELS - 1; level++) {
+            void** slot = &((void**) table)[index(vpage, level)];
+            if (*slot == 0) {
+                *slot = allocate_table(level + 1);
+                new_leaf = (level + 1 == PT_LEVELS - 1);
+            }
+            table = *slot;
+        }
+        return (PTE*) table;
+    }
+
+    // All the allocated leaves, in virtual page order
+    void get_leaves(vector<PTE*>& leaves) const {
+        leaves.clear();
+        collect_leaves(root, 0, leaves);
+    }
+
+    void collect_leaves(void* table, int level, vector<PTE*>& leaves) const {
+        if (level == PT_LEVELS - 1) {
+            leaves.push_back((PTE*) table);
+            return;
+        }
+        for (int i = 0; i < table_size(level); i++) {
+            void* child = ((void**) table)[i];
+            if (child != 0) {
+                collect_leaves(child, level + 1, leaves);
+            }
+        }
     }
 
 };
 
 
 //-------------------- STEP 3 : Create Processes objects --------------------
+// Per process statistics, in the order of the summary line
+enum PStat {
+    PSTAT_UNMAPS,
+    PSTAT_MAPS,
+    PSTAT_INS,
+    PSTAT_OUTS,
+    PSTAT_FINS,
+    PSTAT_FOUTS,
+    PSTAT_ZEROS,
+    PSTAT_SEGV,
+    PSTAT_SEGPROT,
+    NUM_PSTATS
+};
+
 // Second we write the Process class
 struct Process {
 
     int pid; // id of the process in the pool
     int num_vmas; // number of VMAs
     vector<VMA> vmas; // vector storing the VMAs 
-    vector<PTE> pageTable; // page table array storing the PTEs
+    PageTable pageTable; // page table storing the PTEs, allocated lazily
+
+    unsigned long pstats[NUM_PSTATS]; // statistics of the process, indexed by PStat
 
-    map<string, unsigned long> pstats;
+    unsigned long ready_time; // time model : the process is blocked by the read of a page until then
 
     Process(int pid_, int num_vmas_) {
         pid = pid_;
         num_vmas = num_vmas_;
-        for (int i = 0; i < MAX_NUM_PTE; i++) {
-            pageTable.push_back(PTE());
-        }
-        pstats["unmaps"] = 0;
-        pstats["maps"] = 0;
-        pstats["ins"] = 0;
-        pstats["outs"] = 0;
-        pstats["fins"] = 0;
-        pstats["fouts"] = 0;
-        pstats["zeros"] = 0;
-        pstats["segv"] = 0;
-        pstats["segprot"] = 0;
+        ready_time = 0;
+        for (int i = 0; i < NUM_PSTATS; i++) {
+            pstats[i] = 0;
+        }
         
     }
 
-    // Check if a virtual page is in a VMA
+    // Add a VMA to the process. Must be done before the simulation starts : its bits are copied
+    // in the PTEs when their page table leaf is allocated
+    void add_vma(const VMA& vma) {
+        vmas.push_back(vma);
+        // A 1 level page table is a single leaf, allocated with the process
+        if (PT_LEVELS == 1) {
+            apply_vma(vma, pageTable.find_leaf(0), 0);
+        }
+    }
+
+    // Copy the bits of a VMA in the PTEs of the leaf starting at virtual page leaf_start
+    void apply_vma(const VMA& vma, PTE* leaf, int leaf_start) {
+        int start = max(vma.start_page, leaf_start);
+        int end = min(vma.end_page, leaf_start + PT_LEAF_SIZE - 1);
+        for (int vpage = start; vpage <= end; vpage++) {
+            PTE* pte = &leaf[vpage - leaf_start];
+            pte->in_vma = 1;
+            pte->write_protect = vma.write_protected;
+            pte->file_mapped = vma.file_mapped;
+        }
+    }
+
+    // Copy the VMA bits in the PTEs of a new leaf starting at virtual page leaf_start
+    void init_pagetable_leaf(PTE* leaf, int leaf_start) {
+        for (vector<VMA>::const_iterator it = vmas.begin(); it != vmas.end(); it++) {
+            apply_vma(*it, leaf, leaf_start);
+        }
+    }
+
+    // PTE of a virtual page (0 <= vpage < MAX_NUM_PTE), allocating its page table tables if needed
+    PTE* get_pte(int vpage) {
+        bool new_leaf;
+        PTE* leaf = pageTable.get_leaf(vpage, new_leaf);
+        if (new_leaf) {
+            init_pagetable_leaf(leaf, vpage & ~(PT_LEAF_SIZE - 1));
+        }
+        return &leaf[PageTable::index(vpage, PT_LEVELS - 1)];
+    }
+
+    // VMA of a virtual page, 0 if it's in none
+    VMA* find_vma(int vpage) {
+        for (vector<VMA>::iterator it = vmas.begin(); it != vmas.end(); it++) {
+            if (it->start_page <= vpage && vpage <= it->end_page) {
+                return &(*it);
+            }
+        }
+        return 0;
+    }
+
+    // Check if a virtual page is in a VMA, without allocating anything in the page table
     bool isInVMA(int vpage) {
+        if (vpage < 0 || vpage >= MAX_NUM_PTE) {
+            return false; // outside of the address space
+        }
+        PTE* pte = pageTable.find(vpage);
+        if (pte != 0) {
+            return pte->in_vma;
+        }
+        // The leaf was never touched, we have to look at the VMAs themselves
         for (vector<VMA>::const_iterator it = vmas.begin(); it != vmas.end(); it++) {
             if (it->start_page <= vpage && vpage <= it->end_page) {
                 return true;
             }
         }
-        // If we're here, it means the virtual page didn't fit in any VMA
         return false;
     }
 
-    VMA* getVMA(int vpage) {
-        for (vector<VMA>::iterator it = vmas.begin(); it != vmas.end(); it++) {
-            if (it->start_page <= vpage && vpage <= it->end_page) {
-                return &(*it);
+    // Translation done by the MMU for a read or a write : walk the page table and return the PTE,
+    // or 0 if the page is not in a VMA (SEGV). The missing tables of valid pages are allocated.
+    // With -l, the tables read by the walk and the tables allocated are added to the cost
+    PTE* translate(int vpage) {
+        if (vpage < 0 || vpage >= MAX_NUM_PTE) {
+            return 0; // outside of the address space
+        }
+        int tables_read;
+        PTE* leaf = pageTable.find_leaf(vpage, tables_read);
+        if (PT_COSTS) {
+            sim->pt_walks++;
+            sim->pt_walk_reads += tables_read;
+            sim->cost += (unsigned long) tables_read * COST_PT_WALK;
+        }
+        if (leaf != 0) {
+            PTE* pte = &leaf[PageTable::index(vpage, PT_LEVELS - 1)];
+            return pte->in_vma ? pte : 0;
+        }
+        if (!isInVMA(vpage)) {
+            return 0;
+        }
+        // Page fault on a region never touched : the OS allocates the missing tables
+        int num_tables = pageTable.num_tables;
+        PTE* pte = get_pte(vpage);
+        if (PT_COSTS) {
+            sim->cost += (unsigned long) (pageTable.num_tables - num_tables) * COST_PT_ALLOC;
+        }
+        return pte;
+    }
+
+};
+
+// Translation Lookaside Buffer in front of the page tables (-T option). It's a set associative cache of
+// (asid, vpage) -> PTE. A hit saves the page walk, a miss pays COST_TLB_MISS plus the walk.
+// Entries are invalidated when their page is unmapped. Without ASIDs the whole TLB is flushed when
+// we switch to another process. The TLB only changes the cost : the R/M bits are still updated in the
+// PTE on every access so the pagers take the same decisions with or without TLB
+const int COST_TLB_HIT = 0;
+const int COST_TLB_MISS = 20;
+const int COST_TLB_FLUSH = 50;
+
+struct TLBEntry {
+    bool valid;
+    int asid; // pid of the process owning the translation
+    int vpage;
+    PTE* pte;
+    unsigned long last_used; // used for the LRU replacement
+
+    TLBEntry() {
+        valid = false;
+        asid = -1;
+        vpage = -1;
+        pte = 0;
+        last_used = 0;
+    }
+};
+
+struct TLB {
+
+    int num_entries;
+    int num_ways; // associativity, num_entries for a fully associative TLB
+    int num_sets;
+    bool lru; // LRU replacement if true, random replacement otherwise
+    bool use_asid; // entries tagged with the pid, else flush on context switch
+    vector<TLBEntry> entries; // num_sets sets of num_ways entries
+    unsigned long clock; // incremented at each access, for LRU
+    unsigned int seed; // random replacement, independent from the random file of the RANDOM pager
+    int num_valid; // number of valid entries
+
+    TLB(int num_entries_, int num_ways_, bool lru_, bool use_asid_) {
+        num_entries = num_entries_;
+        num_ways = num_ways_;
+        num_sets = num_entries / num_ways;
+        lru = lru_;
+        use_asid = use_asid_;
+        entries.assign(num_sets * num_ways, TLBEntry());
+        clock = 0;
+        seed = 2463534242u;
+        num_valid = 0;
+    }
+
+    TLBEntry* get_set(int vpage) {
+        return &entries[(vpage % num_sets) * num_ways];
+    }
+
+    // PTE cached for (asid, vpage), or 0 on a miss
+    PTE* lookup(int asid, int vpage) {
+        clock++;
+        TLBEntry* set = get_set(vpage);
+        for (int way = 0; way < num_ways; way++) {
+            if (set[way].valid && set[way].vpage == vpage && set[way].asid == asid) {
+                set[way].last_used = clock;
+                sim->tlb_hits++;
+                sim->cost += COST_TLB_HIT;
+                return set[way].pte;
             }
         }
-        // If we're here, it means the virtual page didn't fit in any VMA
-        // But normally, this should never happen because this case should have been taken care
-        // by the SEGFAULT exception
+        sim->tlb_misses++;
+        sim->cost += COST_TLB_MISS;
         return 0;
     }
 
-    void set_write_protection_bit(int vpage) {
-        VMA* vma = getVMA(vpage);
-        PTE* pte = &(pageTable[vpage]);
-        if (vma->write_protected) {
-            pte->write_protect = 1;
+    // Cache a translation after a miss : first invalid way, else the victim of the replacement policy
+    void insert(int asid, int vpage, PTE* pte) {
+        TLBEntry* set = get_set(vpage);
+        TLBEntry* victim = 0;
+        for (int way = 0; way < num_ways && victim == 0; way++) {
+            if (!set[way].valid) {
+                victim = &set[way];
+            }
+        }
+        if (victim == 0) {
+            if (lru) {
+                victim = &set[0];
+                for (int way = 1; way < num_ways; way++) {
+                    if (set[way].last_used < victim->last_used) {
+                        victim = &set[way];
+                    }
+                }
+            } else {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                victim = &set[seed % num_ways];
+            }
         } else {
-            pte->write_protect = 0;
+            num_valid++;
+        }
+        victim->valid = true;
+        victim->asid = asid;
+        victim->vpage = vpage;
+        victim->pte = pte;
+        victim->last_used = clock;
+    }
+
+    // Drop the translation of a page that is being unmapped
+    void invalidate(int asid, int vpage) {
+        TLBEntry* set = get_set(vpage);
+        for (int way = 0; way < num_ways; way++) {
+            if (set[way].valid && set[way].vpage == vpage && set[way].asid == asid) {
+                set[way].valid = false;
+                num_valid--;
+                sim->tlb_invalidations++;
+                return;
+            }
+        }
+    }
+
+    // Context switch to another process. Without ASIDs, the TLB is flushed
+    void switch_process() {
+        if (use_asid || num_valid == 0) {
+            return;
         }
+        for (vector<TLBEntry>::iterator it = entries.begin(); it != entries.end(); it++) {
+            it->valid = false;
+        }
+        num_valid = 0;
+        sim->tlb_flushes++;
+        sim->cost += COST_TLB_FLUSH;
     }
 
 };
 
+
+
 //-------------------- STEP 4 : Create Instructions objects --------------------
 // Third, we create the Instruction objects
 
@@ -154,23 +1084,22 @@ struct Instruction {
     char command; // command instruction c, r, w, e
     int arg; // argument of the command (process id, vpage)
 
-    Instruction (int iid_, char command_, int arg_) {
+    Instruction (int iid_ = -1, char command_ = 0, int arg_ = 0) {
         iid = iid_;
         command = command_;
         arg = arg_;
     }
 
     void print_instr() {
-        printf("%d: ==> %c %d\n", iid, command, arg);
+        sim->output.put(iid); sim->output.put(": ==> "); sim->output.put(command); sim->output.put(' '); sim->output.put(arg); sim->output.put('\n');
     }
 
 };
 
-//-------------------- STEP 5 : Read Input File and initialize the process pool and instruction queues --------------------
-// Now, we can read the input file and initialize the instructions queue and the processes array
-int NUM_PROCESSES = -1;
-queue<Instruction> instructions;
-vector<Process> processes;
+//-------------------- STEP 5 : Read Input File and initialize the process pool and instruction reader --------------------
+// Now, we can read the input file and initialize the processes array.
+// The instructions are NOT loaded in memory : the simulator pulls them one by one from the input stream
+// through an InstructionReader, so memory stays constant whatever the length of the trace
 
 void readInput(istream& input_file) {
     
@@ -183,10 +1112,10 @@ void readInput(istream& input_file) {
     }
 
     // The first non comment line store the number of processes
-    NUM_PROCESSES = stoi(line);
+    sim->NUM_PROCESSES = stoi(line);
 
     // Now we can loop through all the processes :
-    for (int i = 0; i < NUM_PROCESSES; i++) {
+    for (int i = 0; i < sim->NUM_PROCESSES; i++) {
         int pid = i; // pid of the process in the pool
         // We skip the comments lines
         while (getline(input_file, line)) {
@@ -205,80 +1134,578 @@ void readInput(istream& input_file) {
             istringstream issVMA(line);
             issVMA >> start_page >> end_page >> write_protected >> file_mapped;
             VMA vma = VMA(vmaid, start_page, end_page, (bool) write_protected, (bool) file_mapped);
-            process.vmas.push_back(vma);
+            process.add_vma(vma);
         }
-        processes.push_back(process);
+        sim->processes.push_back(process);
     }
 
-
-    // Now we deal with the instructions. We continue to ignore all comments
-    int count = 0; // used to define the instruction id
-    while (getline(input_file, line)) {
-        if (line[0] == '#') {
-            continue; // ignore and go to next line
-        }
-        // Now we know that the instruction line is like that : "command arg" so we parse it
-        char command;
-        int arg;
-        stringstream issInstr(line);
-        issInstr >> command >> arg;
-        Instruction instruction = Instruction(count, command, arg);
-        instructions.push(instruction);
-        count++; 
-    }
+    // The stream is now positioned on the instruction section, the StreamInstructionReader takes it from here
 
 };
 
+// Abstract reader over the input file. The process specification is read once with read_processes(),
+// then the simulator pulls the instructions one at a time with next().
+// Only the current position is kept in memory, so the simulation can start on the first instruction
+// without waiting for the whole trace to be parsed
+struct InstructionReader {
 
-//-------------------- STEP 6 : Create Frame object and frame table --------------------
+    int count; // used to define the instruction id
+
+    InstructionReader() {
+        count = 0;
+    }
+
+    virtual ~InstructionReader() {}
+
+    virtual void read_processes() = 0; // Fill the process pool from the process/VMA specification
+    virtual bool next(Instruction& instr) = 0; // Parse the next instruction. Returns false once the trace is exhausted
+
+};
+
+// Reader based on getline + stringstream. Works on any stream (pipes, stdin...)
+struct StreamInstructionReader: public InstructionReader {
+
+    istream* input_file; // input stream
+    string line; // current line, reused for every instruction
+
+    StreamInstructionReader(istream& input_file_) {
+        input_file = &input_file_;
+    }
+
+    void read_processes() {
+        readInput(*input_file);
+    }
+
+    bool next(Instruction& instr) {
+        // We continue to ignore all comments
+        while (getline(*input_file, line)) {
+            if (line[0] == '#') {
+                continue; // ignore and go to next line
+            }
+            // Now we know that the instruction line is like that : "command arg" so we parse it
+            char command;
+            int arg;
+            stringstream issInstr(line);
+            if (!(issInstr >> command >> arg)) {
+                continue; // blank or malformed line
+            }
+            instr = Instruction(count, command, arg);
+            count++;
+            return true;
+        }
+        return false;
+    }
+
+};
+
+// Zero-copy reader : the input file is mmap'ed and scanned in place with a hand-written tokenizer,
+// so there is no heap allocation per line. Same comment ('#') and VMA-section rules as readInput()
+struct MappedInstructionReader: public InstructionReader {
+
+    const char* buffer; // start of the mapping
+    const char* cur; // current position in the mapping
+    const char* end; // end of the mapping
+    const char* released; // everything before this address was given back to the kernel
+    size_t length; // size of the mapping
+    bool mapped; // false if we read a buffer we don't own (open_buffer)
+
+    // Once we consumed that many bytes, we drop them from our resident set so long traces stay cheap
+    static const size_t RELEASE_CHUNK = 64 << 20;
+
+    MappedInstructionReader() {
+        buffer = cur = end = released = 0;
+        length = 0;
+        mapped = false;
+    }
+
+    ~MappedInstructionReader() {
+        if (mapped && length > 0) {
+            munmap((void*) buffer, length);
+        }
+    }
+
+    // Map the file. Returns false if it can't be mapped (not a regular file, empty file ...)
+    // so the caller can fall back to the StreamInstructionReader
+    bool open(const char* path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd); // the mapping stays valid after closing the file
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        length = st.st_size;
+        buffer = cur = released = (const char*) addr;
+        end = buffer + length;
+        mapped = true;
+        return true;
+    }
+
+    // Read a trace already in memory. The buffer is shared : it's never released nor freed by the reader
+    void open_buffer(const char* data, size_t size) {
+        length = size;
+        buffer = cur = released = data;
+        end = buffer + length;
+        mapped = false;
+    }
+
+    // Give the consumed part of the file back to the kernel from time to time
+    void release_consumed() {
+        if (mapped && (size_t) (cur - released) >= RELEASE_CHUNK) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t len = ((cur - released) / page) * page;
+            madvise((void*) released, len, MADV_DONTNEED);
+            released += len;
+        }
+    }
+
+    // Go to the beginning of the next line
+    void skip_line() {
+        const char* eol = (const char*) memchr(cur, '\n', end - cur);
+        cur = (eol == 0) ? end : eol + 1;
+    }
+
+    // Skip the blanks inside the current line
+    void skip_blanks() {
+        while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == '\r')) {
+            cur++;
+        }
+    }
+
+    // Skip the comment lines, just like the getline loops of readInput()
+    void skip_comments() {
+        while (cur < end && *cur == '#') {
+            skip_line();
+        }
+    }
+
+    // Parse an integer in the current line. Returns false if there is no integer
+    bool parse_int(int& value) {
+        skip_blanks();
+        bool negative = false;
+        if (cur < end && (*cur == '-' || *cur == '+')) {
+            negative = (*cur == '-');
+            cur++;
+        }
+        if (cur == end || *cur < '0' || *cur > '9') {
+            return false;
+        }
+        int v = 0;
+        while (cur < end && *cur >= '0' && *cur <= '9') {
+            v = v * 10 + (*cur - '0');
+            cur++;
+        }
+        value = negative ? -v : v;
+        return true;
+    }
+
+    void read_processes() {
+        int value = 0;
+        // We skip the first comments lines and read the number of processes
+        skip_comments();
+        parse_int(value);
+        sim->NUM_PROCESSES = value;
+        skip_line();
+
+        for (int i = 0; i < sim->NUM_PROCESSES; i++) {
+            // We skip the comments lines and read the number of VMAs
+            skip_comments();
+            int num_vmas = 0;
+            parse_int(num_vmas);
+            skip_line();
+            Process process = Process(i, num_vmas);
+            // The VMA lines directly follow, one per line
+            for (int j = 0; j < num_vmas; j++) {
+                int start_page = 0, end_page = 0, write_protected = 0, file_mapped = 0;
+                parse_int(start_page) && parse_int(end_page) && parse_int(write_protected) && parse_int(file_mapped);
+                skip_line();
+                process.add_vma(VMA(j, start_page, end_page, (bool) write_protected, (bool) file_mapped));
+            }
+            sim->processes.push_back(process);
+        }
+    }
+
+    bool next(Instruction& instr) {
+        while (cur < end) {
+            release_consumed();
+            if (*cur == '#') {
+                skip_line(); // ignore and go to next line
+                continue;
+            }
+            // The instruction line is like that : "command arg"
+            skip_blanks();
+            if (cur == end || *cur == '\n') {
+                skip_line(); // blank line
+                continue;
+            }
+            char command = *cur++;
+            int arg;
+            if (!parse_int(arg)) {
+                skip_line(); // malformed line
+                continue;
+            }
+            skip_line();
+            instr = Instruction(count, command, arg);
+            count++;
+            return true;
+        }
+        return false;
+    }
+
+};
+
+// Binary trace format (version 1), produced by "mmu -x<binfile> inputfile" :
+//   header       : magic "MMUB" + 1 byte version
+//   processes    : varint num_processes, then for each process varint num_vmas
+//                  and for each VMA varint start_page, varint end_page, 1 byte flags (bit 0 write_protected, bit 1 file_mapped)
+//   instructions : 1 byte each : 2 high bits = opcode (c, r, w, e), 6 low bits = argument.
+//                  Arguments >= 63 store 63 in the low bits and are followed by varint(arg - 63)
+// Varints are unsigned LEB128 (7 bits per byte, high bit set while more bytes follow)
+const char BINARY_TRACE_MAGIC[4] = {'M', 'M', 'U', 'B'};
+const unsigned char BINARY_TRACE_VERSION = 1;
+const int BINARY_TRACE_HEADER_SIZE = 5;
+const char BINARY_TRACE_OPCODES[4] = {'c', 'r', 'w', 'e'};
+const int BINARY_TRACE_ARG_ESCAPE = 63;
+
+// Replay a binary trace. The file is mmap'ed just like the text one, only the decoding changes
+struct BinaryInstructionReader: public MappedInstructionReader {
+
+    // Check the magic and the version of the trace and go past the header
+    bool check_header() {
+        if (length < (size_t) BINARY_TRACE_HEADER_SIZE || memcmp(buffer, BINARY_TRACE_MAGIC, 4) != 0) {
+            return false;
+        }
+        if ((unsigned char) buffer[4] != BINARY_TRACE_VERSION) {
+            fprintf(stderr, "Unsupported binary trace version %d (expected %d)\n",
+                    (unsigned char) buffer[4], BINARY_TRACE_VERSION);
+            return false;
+        }
+        cur = buffer + BINARY_TRACE_HEADER_SIZE;
+        return true;
+    }
+
+    unsigned int parse_varint() {
+        unsigned int value = 0;
+        int shift = 0;
+        while (cur < end) {
+            unsigned char byte = *cur++;
+            value |= (unsigned int) (byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+            shift += 7;
+        }
+        return value;
+    }
+
+    void read_processes() {
+        sim->NUM_PROCESSES = parse_varint();
+        for (int i = 0; i < sim->NUM_PROCESSES; i++) {
+            int num_vmas = parse_varint();
+            Process process = Process(i, num_vmas);
+            for (int j = 0; j < num_vmas; j++) {
+                int start_page = parse_varint();
+                int end_page = parse_varint();
+                unsigned char flags = (cur < end) ? *cur++ : 0;
+                process.add_vma(VMA(j, start_page, end_page, (bool) (flags & 1), (bool) (flags & 2)));
+            }
+            sim->processes.push_back(process);
+        }
+    }
+
+    bool next(Instruction& instr) {
+        if (cur >= end) {
+            return false;
+        }
+        release_consumed();
+        unsigned char byte = *cur++;
+        int arg = byte & 0x3f;
+        if (arg == BINARY_TRACE_ARG_ESCAPE) {
+            arg += parse_varint();
+        }
+        instr = Instruction(count, BINARY_TRACE_OPCODES[byte >> 6], arg);
+        count++;
+        return true;
+    }
+
+};
+
+// Small buffered writer used by the text -> binary converter
+struct BinaryTraceWriter {
+
+    FILE* file;
+    unsigned long num_bytes; // bytes written so far
+
+    BinaryTraceWriter(FILE* file_) {
+        file = file_;
+        num_bytes = 0;
+        setvbuf(file, 0, _IOFBF, 1 << 20);
+    }
+
+    void put_byte(unsigned char byte) {
+        putc(byte, file);
+        num_bytes++;
+    }
+
+    void put_varint(unsigned int value) {
+        while (value >= 0x80) {
+            put_byte((unsigned char) (value | 0x80));
+            value >>= 7;
+        }
+        put_byte((unsigned char) value);
+    }
+
+};
+
+// Convert any trace into a binary trace. Returns the number of instructions written or -1 on error
+long convert_to_binary(InstructionReader* reader, FILE* out_file) {
+    BinaryTraceWriter writer = BinaryTraceWriter(out_file);
+    for (int i = 0; i < 4; i++) {
+        writer.put_byte(BINARY_TRACE_MAGIC[i]);
+    }
+    writer.put_byte(BINARY_TRACE_VERSION);
+
+    sim->processes.clear();
+    reader->read_processes();
+    writer.put_varint(sim->processes.size());
+    for (vector<Process>::iterator it_proc = sim->processes.begin(); it_proc != sim->processes.end(); it_proc++) {
+        writer.put_varint(it_proc->vmas.size());
+        for (vector<VMA>::iterator it_vma = it_proc->vmas.begin(); it_vma != it_proc->vmas.end(); it_vma++) {
+            if (it_vma->start_page < 0 || it_vma->end_page < 0) {
+                fprintf(stderr, "Negative page in VMA %d of process %d\n", it_vma->vmaid, it_proc->pid);
+                return -1;
+            }
+            writer.put_varint(it_vma->start_page);
+            writer.put_varint(it_vma->end_page);
+            writer.put_byte((it_vma->write_protected ? 1 : 0) | (it_vma->file_mapped ? 2 : 0));
+        }
+    }
+
+    long num_instructions = 0;
+    Instruction instr;
+    while (reader->next(instr)) {
+        const char* opcode = (const char*) memchr(BINARY_TRACE_OPCODES, instr.command, 4);
+        if (opcode == 0 || instr.arg < 0) {
+            fprintf(stderr, "Can't encode instruction %d: %c %d\n", instr.iid, instr.command, instr.arg);
+            return -1;
+        }
+        unsigned char byte = (unsigned char) ((opcode - BINARY_TRACE_OPCODES) << 6);
+        if (instr.arg < BINARY_TRACE_ARG_ESCAPE) {
+            writer.put_byte(byte | instr.arg);
+        } else {
+            writer.put_byte(byte | BINARY_TRACE_ARG_ESCAPE);
+            writer.put_varint(instr.arg - BINARY_TRACE_ARG_ESCAPE);
+        }
+        num_instructions++;
+    }
+    return num_instructions;
+}
+
+// Open the best reader for the input file : binary traces are detected with their magic,
+// text traces use the mmap reader when possible and the stream reader otherwise.
+// Returns 0 if the file is a binary trace we can't read
+InstructionReader* open_instruction_reader(const char* path, ifstream& input_file) {
+    BinaryInstructionReader* binary_reader = new BinaryInstructionReader();
+    if (binary_reader->open(path)) {
+        if (binary_reader->check_header()) {
+            return binary_reader;
+        }
+        if (binary_reader->length >= 4 && memcmp(binary_reader->buffer, BINARY_TRACE_MAGIC, 4) == 0) {
+            delete binary_reader;
+            return 0; // binary trace with a wrong version
+        }
+        // Not a binary trace : we rewind and read it as text
+        delete binary_reader;
+        MappedInstructionReader* mapped_reader = new MappedInstructionReader();
+        mapped_reader->open(path);
+        return mapped_reader;
+    }
+    delete binary_reader;
+    return new StreamInstructionReader(input_file);
+}
+
+// The trace of a run, read a second time by OPT and by -oR : the input file, or the binary trace it was
+// converted to when it's already in memory (MmuTrace)
+struct TraceSource {
+    const char* path; // 0 if there is no file, for the synthetic traces of the benchmarks
+    const char* data; // 0 if the trace is only in the file
+    size_t size;
+
+    TraceSource(const char* path_, const char* data_ = 0, size_t size_ = 0) {
+        path = path_;
+        data = data_;
+        size = size_;
+    }
+};
+
+// Open another reader on the trace, its processes not read yet. A stream reader reads input_file, which must
+// outlive it. Returns 0 and sets error if the trace can't be read again
+InstructionReader* reopen_trace(const TraceSource& trace, ifstream& input_file, string& error) {
+    if (trace.data != 0) {
+        BinaryInstructionReader* reader = new BinaryInstructionReader();
+        reader->open_buffer(trace.data, trace.size);
+        reader->check_header();
+        return reader;
+    }
+    struct stat input_stat;
+    if (trace.path == 0 || stat(trace.path, &input_stat) != 0 || !S_ISREG(input_stat.st_mode)) {
+        error = "OPT needs to read the input twice, please give a regular input file.";
+        return 0;
+    }
+    input_file.open(trace.path);
+    InstructionReader* reader = open_instruction_reader(trace.path, input_file);
+    if (reader == 0) {
+        error = "Could not read the input file " + string(trace.path) + " again for OPT.";
+    }
+    return reader;
+}
+
+// Pipelined mode (-p2, -p3) : the instructions of another reader are parsed by a thread of its own, in batches
+// passed through an SpscRing, while the simulation consumes them. The ring holds at most
+// RING_SIZE * BATCH_SIZE instructions, so the memory stays bounded whatever the length of the trace.
+// The process specification is still read by the simulation thread, the parser only calls next()
+struct PipelinedInstructionReader: public InstructionReader {
+
+    static const int BATCH_SIZE = 4096;
+    static const int RING_SIZE = 16;
+
+    struct Batch {
+        Instruction instrs[BATCH_SIZE];
+        int size;
+    };
+
+    InstructionReader* reader; // parsed by the parser thread, not owned
+    SpscRing<Batch> batches;
+    thread parser_thread;
+    Batch* batch; // batch being simulated, 0 before the first one
+    int batch_pos;
+
+    PipelinedInstructionReader(InstructionReader* reader_) : batches(RING_SIZE) {
+        reader = reader_;
+        batch = 0;
+        batch_pos = 0;
+    }
+
+    ~PipelinedInstructionReader() {
+        // The simulation may stop before the end of the trace : the parser must not wait for room forever
+        batches.cancel();
+        if (parser_thread.joinable()) {
+            parser_thread.join();
+        }
+    }
+
+    void parse_batches() {
+        Batch* next_batch;
+        while ((next_batch = batches.acquire()) != 0) {
+            next_batch->size = 0;
+            while (next_batch->size < BATCH_SIZE && reader->next(next_batch->instrs[next_batch->size])) {
+                next_batch->size++;
+            }
+            bool last = (next_batch->size < BATCH_SIZE);
+            batches.publish();
+            if (last) {
+                break;
+            }
+        }
+        batches.close();
+    }
+
+    void read_processes() {
+        reader->read_processes();
+        parser_thread = thread(&PipelinedInstructionReader::parse_batches, this);
+    }
+
+    bool next(Instruction& instr) {
+        while (batch == 0 || batch_pos == batch->size) {
+            if (batch != 0) {
+                batches.pop();
+            }
+            batch = batches.front();
+            batch_pos = 0;
+            if (batch == 0) {
+                return false;
+            }
+        }
+        instr = batch->instrs[batch_pos++]; // the iid was set by the parser
+        count++;
+        return true;
+    }
+
+};
+
+
+//-------------------- STEP 6 : Create Frame object and frame table --------------------
 struct Frame {
 
     int fid; // Frame id which serves to index it in the frame table vector
     Process* process; // pointer of the process owning the frame
     int vpage; // vpage of the process page table owning the frame
+    PTE* pte; // PTE of vpage, kept while the frame is mapped so we don't walk the page table again
     bool isFree; // check if the frame is free to use
     // Special Flag used for the exit instruciton : Differenciate between FOUT or "OUT" 
     // (in latter case, we need to put the frame in the free pool instead of the swap area)
     bool toFreePool; 
 
-    unsigned int age; // Used for aging algorithm
     int time_last_used; // Used for working set algorithm
 
+    int next_free; // fid of the next frame in the free pool (-1 if last or not in the pool)
+
+    bool prefetched; // mapped by a readahead and not accessed yet
+    unsigned long ready_time; // time model : a prefetched page can't be used before its read completes
+
     Frame (int fid_) {
         fid = fid_;
         process = 0; 
         vpage = -1;
+        pte = 0;
         isFree = true;
         toFreePool = false;
-        age =  0;
         time_last_used = 0;
+        next_free = -1;
+        prefetched = false;
+        ready_time = 0;
     }
 
     // Retrieve pte of frame
     PTE* get_pte() {
-        PTE* pte = &(process->pageTable[vpage]);
         return pte;
     }
 
     // We must define 2 unmap functions. One for read and write instructions and one for the exit instruction
     // I use the C++ default parameters feature for that
     void unmap(bool onExit = false) {
-        printf(" UNMAP %d:%d\n", process->pid, vpage);
+        if (sim->OUTPUT_OPS) { sim->output.event("UNMAP", process->pid, vpage); }
+        if (prefetched) {
+            sim->readahead_wasted++;
+            prefetched = false;
+        }
+        if (sim->tlb != 0) {
+            sim->tlb->invalidate(process->pid, vpage);
+        }
 //        cout << " UNMAP " << process->pid << ":" << vpage << endl;
-        process->pstats["unmaps"]++;
+        process->pstats[PSTAT_UNMAPS]++;
 
         // Unmap the frame
-        PTE* pte = &(process->pageTable[vpage]);
-        VMA* vma = process->getVMA(vpage);
 
         // If modified : either going to file device or to swap area
         if (pte->modified) {
             // If file mapped -> FOUT
-            if (vma->file_mapped) {
-                cost += COST_FOUT;
-                printf(" FOUT\n");
+            if (pte->file_mapped) {
+                sim->cost += sim->costs.fout;
+                if (sim->time != 0) {
+                    sim->time->io(sim->time->file, sim->costs.fout, true, sim->cost);
+                }
+                if (sim->OUTPUT_OPS) { sim->output.event("FOUT"); }
 //                cout << " FOUT" << endl;
-                process->pstats["fouts"]++;
+                process->pstats[PSTAT_FOUTS]++;
             }
             // If the instruction is exit -> go to free pool
             else if (onExit) {
@@ -290,10 +1717,13 @@ struct Frame {
             } 
             // Last case scenario is go to swap device -> OUT
             else {
-                cost += COST_OUT;
-                printf(" OUT\n");
+                sim->cost += sim->costs.out;
+                if (sim->time != 0) {
+                    sim->time->io(sim->time->swap, sim->costs.out, true, sim->cost);
+                }
+                if (sim->OUTPUT_OPS) { sim->output.event("OUT"); }
 //                cout << " OUT" << endl;
-                process->pstats["outs"]++;
+                process->pstats[PSTAT_OUTS]++;
                 // In this case, page is put in swap space, so we set the pagedout bit
                 pte->pagedout = 1;
 
@@ -311,85 +1741,120 @@ struct Frame {
 
         process = 0;
         vpage = -1;
+        pte = 0;
         isFree = true;
     }
 
-    void map(Process* process_, int vpage_) {
+    // prefetch is set for the pages of a readahead batch : they're read with the rest of the batch
+    void map(Process* process_, int vpage_, bool prefetch = false) {
         isFree = false;
         process = process_;
         vpage = vpage_;
 
-        PTE* pte = &(process->pageTable[vpage]);
+        pte = process->get_pte(vpage);
 
         // Set the PTE valid bit
         pte->valid = 1;
-        
-        VMA* vma = process->getVMA(vpage);
 
+        // Readahead of a page of the file or of the swap area, much cheaper than a FIN or an IN of its own
+        if (prefetch) {
+            sim->cost += sim->costs.prefetch;
+            if (sim->time != 0) {
+                IoDevice& device = pte->file_mapped ? sim->time->file : sim->time->swap;
+                ready_time = sim->time->io(device, sim->costs.prefetch, false, sim->cost);
+            }
+            if (sim->OUTPUT_OPS) { sim->output.event("PREFETCH", process->pid, vpage); }
+            pte->modified = 0;
+            pte->referenced = 0; // left by its previous mapping : the first access must set it
+            prefetched = true;
+        }
         // If file mapped, it's always -> FIN
-        if (vma->file_mapped) {
-            cost += COST_FIN;
-            printf(" FIN\n");
+        else if (pte->file_mapped) {
+            sim->cost += sim->costs.fin;
+            if (sim->time != 0) {
+                sim->time->block(sim->time->io(sim->time->file, sim->costs.fin, false, sim->cost));
+            }
+            if (sim->OUTPUT_OPS) { sim->output.event("FIN"); }
 //            cout << " FIN" << endl;
-            process->pstats["fins"]++;
+            process->pstats[PSTAT_FINS]++;
             pte->modified = 0; // Reset modified bit
         }
         // else if it comes from swap area -> IN
         else if (pte->pagedout) {
-            cost += COST_IN;
-            printf(" IN\n");
+            sim->cost += sim->costs.in;
+            if (sim->time != 0) {
+                sim->time->block(sim->time->io(sim->time->swap, sim->costs.in, false, sim->cost));
+            }
+            if (sim->OUTPUT_OPS) { sim->output.event("IN"); }
 //            cout << " IN" << endl;
-            process->pstats["ins"]++;
+            process->pstats[PSTAT_INS]++;
             pte->modified = 0; // reset modified bit
         } 
         // else it comes from free pool or is still ZERO -> ZERO
         else {
-            cost += COST_ZERO;
-            printf(" ZERO\n");
+            sim->cost += sim->costs.zero;
+            if (sim->OUTPUT_OPS) { sim->output.event("ZERO"); }
 //            cout << " ZERO" << endl;
-            process->pstats["zeros"]++;
+            process->pstats[PSTAT_ZEROS]++;
         }
 
-        // reset the age and update clock time
-        age = 0;
-        time_last_used = inst_count - 1;
+        // update clock time
+        time_last_used = sim->inst_count - 1;
 
-        printf(" MAP %d\n", fid);
+        if (sim->OUTPUT_OPS) { sim->output.event("MAP", fid); }
 //        cout << " MAP " << fid << endl;
     }
 
 };
-// Global Frame table
-vector<Frame> frameTable;
-// Free Frame pool
-queue<Frame> frameFreePool;
 
-// Initialize frame free pool with empty frames once we know the frame table size given in argument
-void initFrameFreePool(int MAX_NUM_FRAMES_) {
-    for (int i = 0; i < MAX_NUM_FRAMES_; i++) {
-        frameFreePool.push( Frame(i) );
+// Put a frame at the end of the free pool
+void release_frame_to_free_list(Frame* frame) {
+    frame->next_free = -1;
+    if (sim->frameFreePoolTail == -1) {
+        sim->frameFreePoolHead = frame->fid;
+    } else {
+        sim->frameTable[sim->frameFreePoolTail].next_free = frame->fid;
     }
+    sim->frameFreePoolTail = frame->fid;
+    sim->numFreeFrames++;
 }
 
 // Initialize frame table with empty frames once we know the frame table size given in argument
 void initFrameTable(int MAX_NUM_FRAMES_) {
     for (int i = 0; i < MAX_NUM_FRAMES_; i++) {
-        frameTable.push_back( Frame(i) );
+        sim->frameTable.push_back( Frame(i) );
+    }
+}
+
+// Initialize frame free pool with all the frames of the frame table, in order
+void initFrameFreePool(int MAX_NUM_FRAMES_) {
+    for (int i = 0; i < MAX_NUM_FRAMES_; i++) {
+        release_frame_to_free_list(&sim->frameTable[i]);
     }
 }
 
 // Check if free pool is empty and if not,  returns the first available one (in order they were released)
 Frame* allocate_frame_from_free_list() {
-    if ( frameFreePool.empty() ) {
+    if ( sim->frameFreePoolHead == -1 ) {
         return 0;
     }
     else {
-        Frame* free_frame = &(frameFreePool.front());
-        frameFreePool.pop();
+        Frame* free_frame = &(sim->frameTable[sim->frameFreePoolHead]);
+        sim->frameFreePoolHead = free_frame->next_free;
+        if (sim->frameFreePoolHead == -1) {
+            sim->frameFreePoolTail = -1;
+        }
+        free_frame->next_free = -1;
+        sim->numFreeFrames--;
         return free_frame;
     }
 }
 
+Simulation::~Simulation() {
+    delete tlb;
+    delete time;
+}
+
 //-------------------- STEP 7 : Create Abstract class for Pager Algorithms --------------------
 
 class Pager {
@@ -398,186 +1863,707 @@ class Pager {
         int hand; // hand of the pager
         int daemon_clock;
         int TAU;
+        bool tracks_accesses; // true if the pager wants on_access, the simulator skips the call otherwise
 
         virtual Frame* select_victim_frame() = 0; // Return the allocated frame
 
+        // Notifications from the simulator, for the pagers keeping their own index of the frames
+        virtual void on_fault(Process*, int) {} // page fault on vpage, before a frame is found for it
+        virtual void on_map(Frame*) {} // frame was just mapped by a page fault
+        // frame was just mapped by a readahead, after an on_fault for its page. Its R bit is 0 and it may never be
+        // accessed : the pagers assuming in on_map that the page is about to be referenced must not
+        virtual void on_prefetch(Frame* frame) { on_map(frame); }
+        // frame was selected as a victim by a readahead but its page stays : the pager takes it back as if it had
+        // just been mapped by a fault, its R bit is set
+        virtual void on_keep(Frame* frame) { on_map(frame); }
+        virtual void on_reference(Frame*) {} // the R bit of the page in frame went from 0 to 1
+        virtual void on_modify(Frame*) {} // the M bit of the page in frame went from 0 to 1
+        virtual void on_access(Frame*) {} // every read/write of the page in frame, if tracks_accesses
+        // frame was released to the free pool by an exit or by the reclaim daemon. With the daemon, the free pool
+        // isn't always empty when a victim is selected : the pagers must never pick a free frame
+        virtual void on_free(Frame*) {}
+
         Pager() {
             hand = 0;
             daemon_clock = 0;
-            TAU = 49;
+            TAU = sim->WORKING_SET_TAU;
+            tracks_accesses = false;
         }
 
+        virtual ~Pager() {}
+
 };
 
 
-//-------------------- STEP 8 : Create the different Pager Algorithms --------------------
+// Kernels over the per-frame state arrays of FrameStateMirror, with one version per instruction set.
+// All the versions give exactly the same results, the vector ones just handle 4 to 32 frames per instruction.
+// ages : age of each frame. referenced : R bit of the page in each frame (0 or 1)
+struct FrameKernels {
+    const char* name;
+    // Aging pass : shift every age and set its leading bit if the frame was referenced
+    void (*age_frames)(unsigned int* ages, const unsigned char* referenced, int n);
+    // Lowest age of the n frames (n >= 1)
+    unsigned int (*min_age)(const unsigned int* ages, int n);
+    // First frame in [from, to) with the given age, -1 if none
+    int (*find_age)(const unsigned int* ages, int from, int to, unsigned int age);
+    // First frame in [from, to) with its R bit set, -1 if none
+    int (*find_referenced)(const unsigned char* referenced, int from, int to);
+};
 
-class FIFO: public Pager {
+void age_frames_scalar(unsigned int* ages, const unsigned char* referenced, int n) {
+    for (int i = 0; i < n; i++) {
+        ages[i] = (ages[i] >> 1) | ((unsigned int) referenced[i] << 31);
+    }
+}
 
-    // This function is called if the frame table is FULL (frameTable.size() == MAX_NUM_FRAMES)
-    Frame* select_victim_frame() {
-        Frame* victim_frame = &frameTable[hand];
-        hand = (hand + 1) % MAX_NUM_FRAMES; 
-        return victim_frame;
+unsigned int min_age_scalar(const unsigned int* ages, int n) {
+    unsigned int min_age = ages[0];
+    for (int i = 1; i < n; i++) {
+        if (ages[i] < min_age) {
+            min_age = ages[i];
+        }
     }
+    return min_age;
+}
 
-};
+int find_age_scalar(const unsigned int* ages, int from, int to, unsigned int age) {
+    for (int i = from; i < to; i++) {
+        if (ages[i] == age) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-class CLOCK: public Pager {
+int find_referenced_scalar(const unsigned char* referenced, int from, int to) {
+    for (int i = from; i < to; i++) {
+        if (referenced[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-    PTE* get_pte_from_hand(int hand) {
-        Frame* frame = &frameTable[hand];
-        PTE* pte = frame->get_pte();
-        return pte;
+const FrameKernels SCALAR_FRAME_KERNELS = {"scalar", age_frames_scalar, min_age_scalar, find_age_scalar,
+        find_referenced_scalar};
+
+#if defined(__x86_64__)
+// SSE2 is always there on x86-64. The vector loops stop before the last partial vector,
+// the scalar versions finish the job
+
+void age_frames_sse2(unsigned int* ages, const unsigned char* referenced, int n) {
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i r8 = _mm_loadu_si128((const __m128i*) (referenced + i));
+        __m128i r16_lo = _mm_unpacklo_epi8(r8, zero);
+        __m128i r16_hi = _mm_unpackhi_epi8(r8, zero);
+        __m128i r32[4] = {_mm_unpacklo_epi16(r16_lo, zero), _mm_unpackhi_epi16(r16_lo, zero),
+                _mm_unpacklo_epi16(r16_hi, zero), _mm_unpackhi_epi16(r16_hi, zero)};
+        for (int k = 0; k < 4; k++) {
+            __m128i* a = (__m128i*) (ages + i + 4*k);
+            __m128i age = _mm_loadu_si128(a);
+            _mm_storeu_si128(a, _mm_or_si128(_mm_srli_epi32(age, 1), _mm_slli_epi32(r32[k], 31)));
+        }
     }
+    age_frames_scalar(ages + i, referenced + i, n - i);
+}
 
-    // This function is called if the frame table is FULL (frameTable.size() == MAX_NUM_FRAMES)
-    Frame* select_victim_frame() {
+unsigned int min_age_sse2(const unsigned int* ages, int n) {
+    // No unsigned 32 bits min in SSE2 : we flip the sign bit and use the signed comparison
+    const __m128i bias = _mm_set1_epi32(0x80000000);
+    __m128i min_biased = _mm_set1_epi32(0x7fffffff); // biased 0xffffffff
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i age = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (ages + i)), bias);
+        __m128i greater = _mm_cmpgt_epi32(min_biased, age);
+        min_biased = _mm_or_si128(_mm_and_si128(greater, age), _mm_andnot_si128(greater, min_biased));
+    }
+    unsigned int lanes[4];
+    _mm_storeu_si128((__m128i*) lanes, _mm_xor_si128(min_biased, bias));
+    unsigned int min_age = min_age_scalar(lanes, 4);
+    if (i < n) {
+        min_age = min(min_age, min_age_scalar(ages + i, n - i));
+    }
+    return min_age;
+}
 
-        PTE* victim_pte = get_pte_from_hand(hand);
+int find_age_sse2(const unsigned int* ages, int from, int to, unsigned int age) {
+    const __m128i target = _mm_set1_epi32(age);
+    int i = from;
+    for (; i + 4 <= to; i += 4) {
+        __m128i equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*) (ages + i)), target);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(equal));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return find_age_scalar(ages, i, to, age);
+}
 
-        // While the pages are referenced, we reset them to 0 and advance
-        while ( victim_pte->referenced ) {
-            victim_pte->referenced = 0;
-            hand = (hand + 1) % MAX_NUM_FRAMES; 
-            victim_pte = get_pte_from_hand(hand);
+int find_referenced_sse2(const unsigned char* referenced, int from, int to) {
+    const __m128i zero = _mm_setzero_si128();
+    int i = from;
+    for (; i + 16 <= to; i += 16) {
+        __m128i unset = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (referenced + i)), zero);
+        int mask = _mm_movemask_epi8(unset) ^ 0xffff;
+        if (mask) {
+            return i + __builtin_ctz(mask);
         }
-        // We step out of the while loop once we found a page with referenced bit = 0
-        // So the victim frame is the physical adress of the last victim_frame of the loop
-        int frameID = victim_pte->physAddr;
-        Frame* victim_frame = &(frameTable[frameID]);
+    }
+    return find_referenced_scalar(referenced, i, to);
+}
 
-        hand = (hand + 1) % MAX_NUM_FRAMES; // advance hand for next call
+const FrameKernels SSE2_FRAME_KERNELS = {"sse2", age_frames_sse2, min_age_sse2, find_age_sse2,
+        find_referenced_sse2};
 
-        return victim_frame;
+// AVX2 versions, compiled for AVX2 whatever the flags of the build and only used if the CPU has it
+
+__attribute__((target("avx2")))
+void age_frames_avx2(unsigned int* ages, const unsigned char* referenced, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i r32 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (referenced + i)));
+        __m256i* a = (__m256i*) (ages + i);
+        __m256i age = _mm256_loadu_si256(a);
+        _mm256_storeu_si256(a, _mm256_or_si256(_mm256_srli_epi32(age, 1), _mm256_slli_epi32(r32, 31)));
     }
+    age_frames_scalar(ages + i, referenced + i, n - i);
+}
 
-};
+__attribute__((target("avx2")))
+unsigned int min_age_avx2(const unsigned int* ages, int n) {
+    __m256i min_vector = _mm256_set1_epi32(-1);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        min_vector = _mm256_min_epu32(min_vector, _mm256_loadu_si256((const __m256i*) (ages + i)));
+    }
+    unsigned int lanes[8];
+    _mm256_storeu_si256((__m256i*) lanes, min_vector);
+    unsigned int min_age = min_age_scalar(lanes, 8);
+    if (i < n) {
+        min_age = min(min_age, min_age_scalar(ages + i, n - i));
+    }
+    return min_age;
+}
 
-class EnhancedSecondChance: public Pager {
+__attribute__((target("avx2")))
+int find_age_avx2(const unsigned int* ages, int from, int to, unsigned int age) {
+    const __m256i target = _mm256_set1_epi32(age);
+    int i = from;
+    for (; i + 8 <= to; i += 8) {
+        __m256i equal = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*) (ages + i)), target);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(equal));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return find_age_scalar(ages, i, to, age);
+}
 
-    PTE* get_pte_from_hand(int hand) {
-        Frame* frame = &frameTable[hand];
-        PTE* pte = frame->get_pte();
-        return pte;
+__attribute__((target("avx2")))
+int find_referenced_avx2(const unsigned char* referenced, int from, int to) {
+    const __m256i zero = _mm256_setzero_si256();
+    int i = from;
+    for (; i + 32 <= to; i += 32) {
+        __m256i unset = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (referenced + i)), zero);
+        unsigned int mask = ~ (unsigned int) _mm256_movemask_epi8(unset);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
     }
+    return find_referenced_scalar(referenced, i, to);
+}
 
-    int get_class(PTE* pte) {
-        // We define the class as 2*R + M just like in the lectures
-        return 2*pte->referenced + pte->modified;
+const FrameKernels AVX2_FRAME_KERNELS = {"avx2", age_frames_avx2, min_age_avx2, find_age_avx2,
+        find_referenced_avx2};
+#endif
+
+// All the kernel versions this CPU can run, the best one last
+vector<FrameKernels> available_frame_kernels() {
+    vector<FrameKernels> kernels;
+    kernels.push_back(SCALAR_FRAME_KERNELS);
+#if defined(__x86_64__)
+    kernels.push_back(SSE2_FRAME_KERNELS);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(AVX2_FRAME_KERNELS);
     }
+#endif
+    return kernels;
+}
 
-    void daemon_reset() {
-        for (vector<Frame>::iterator it_frame = frameTable.begin(); it_frame != frameTable.end(); it_frame++) {
-            Process* process = it_frame->process;
-            int victim_vpage = it_frame->vpage;
-            PTE* pte = &(process->pageTable[victim_vpage]);
-            if (pte->valid) {
-                pte->referenced = 0;
-            }
-        }
+// Kernels used by the pagers
+FrameKernels frame_kernels = available_frame_kernels().back();
+
+// Structure of arrays copy of the hot state of the frames, for the pagers sweeping the whole frame table.
+// Going through frameTable touches a whole Frame and its PTE for each frame, here a sweep reads
+// a few bytes per frame in consecutive arrays and runs with the kernels above.
+// The pager keeps it in sync with the PTEs from its on_map / on_reference notifications
+struct FrameStateMirror {
+    vector<unsigned int> ages;
+    vector<unsigned char> referenced; // R bit of the page mapped in each frame
+    vector<PTE*> owners; // PTE of the page mapped in each frame
+
+    FrameStateMirror() {
+        ages.assign(sim->MAX_NUM_FRAMES, 0);
+        referenced.assign(sim->MAX_NUM_FRAMES, 0);
+        owners.assign(sim->MAX_NUM_FRAMES, (PTE*) 0);
     }
 
-    // This function is called if the frame table is FULL (frameTable.size() == MAX_NUM_FRAMES)
-    Frame* select_victim_frame() {
+    // referenced_ is false for a prefetched page, true for a fault (it's about to be referenced)
+    void map(Frame* frame, bool referenced_) {
+        PTE* pte = frame->get_pte();
+        owners[frame->fid] = pte;
+        ages[frame->fid] = 0;
+        referenced[frame->fid] = referenced_;
+    }
 
-        Frame* victim_frame = 0;
-        for (int class_ = 0; class_ < 4; class_++ ) {
-            PTE* victim_pte = get_pte_from_hand(hand);
-            int victim_class = get_class(victim_pte);
+    // Reset the R bit of all the frames, in the mirror and in the PTEs
+    void clear_referenced() {
+        int num_frames = (int) referenced.size();
+        int fid = frame_kernels.find_referenced(&referenced[0], 0, num_frames);
+        while (fid != -1) {
+            owners[fid]->referenced = 0;
+            referenced[fid] = 0;
+            fid = frame_kernels.find_referenced(&referenced[0], fid + 1, num_frames);
+        }
+    }
+};
 
-            // If the first element is already the victim frame, we can choose it and stop  searching
-            if ( victim_class == class_ ) {
-                int frameID = victim_pte->physAddr;
-                victim_frame = &(frameTable[frameID]);
+// Set of frames kept as a bitmap with summary levels : bit i of level k+1 is set if the 64 bits word i of
+// level k is not 0. The next frame of the set from any position is found by climbing to the first level
+// with a set bit after it and going down, a few words whatever the number of frames
+struct FrameBitmap {
+    vector<int> num_bits; // number of bits of each level
+    vector< vector<unsigned long long> > levels; // levels[0] has one bit per frame, the last level is 1 word
+
+    FrameBitmap(int size) {
+        int bits = size;
+        while (true) {
+            int words = (bits + 63) / 64;
+            num_bits.push_back(bits);
+            levels.push_back(vector<unsigned long long>(max(words, 1), 0));
+            if (words <= 1) {
                 break;
             }
+            bits = words;
+        }
+    }
 
-            // We look for the first frame of that class.
-            // If no frames exists, this means we made a full clock so exit the while loop and search for the next class
-            int start_clock = hand;
-            while ( victim_class != class_ ) {                
-                hand = (hand + 1) % MAX_NUM_FRAMES;
-                if (hand == start_clock) {
-                    // This means we did a full clock turn, so no frames of this class exist => we exit and look for next class
-                    break;
-                }
-                victim_pte = get_pte_from_hand(hand);
-                victim_class = get_class(victim_pte);
-            }
+    bool test(int i) {
+        return (levels[0][i >> 6] >> (i & 63)) & 1;
+    }
 
-            // If we made a full clock, we check next class
-            if (hand == start_clock) {
-                continue;
+    void set(int i) {
+        for (size_t level = 0; level < levels.size(); level++) {
+            unsigned long long& word = levels[level][i >> 6];
+            bool was_empty = (word == 0);
+            word |= 1ULL << (i & 63);
+            if (!was_empty) {
+                return; // the upper levels already know this word is not empty
             }
+            i >>= 6;
+        }
+    }
 
-            // Else we return this Frame
-            int frameID = victim_pte->physAddr;
-            victim_frame = &(frameTable[frameID]);
-            break;
+    void clear(int i) {
+        for (size_t level = 0; level < levels.size(); level++) {
+            unsigned long long& word = levels[level][i >> 6];
+            word &= ~(1ULL << (i & 63));
+            if (word != 0) {
+                return;
+            }
+            i >>= 6;
         }
+    }
 
-        // last hand update for next function call
-        hand = (hand + 1) % MAX_NUM_FRAMES;
+    // Set the bits [lo, hi) of a level with word operations, then the summary bits of the words touched
+    void set_range(int lo, int hi, size_t level = 0) {
+        if (lo >= hi) {
+            return;
+        }
+        vector<unsigned long long>& words = levels[level];
+        int first_word = lo >> 6;
+        int last_word = (hi - 1) >> 6;
+        unsigned long long first_mask = ~0ULL << (lo & 63);
+        unsigned long long last_mask = ~0ULL >> (63 - ((hi - 1) & 63));
+        if (first_word == last_word) {
+            words[first_word] |= first_mask & last_mask;
+        } else {
+            words[first_word] |= first_mask;
+            for (int w = first_word + 1; w < last_word; w++) {
+                words[w] = ~0ULL;
+            }
+            words[last_word] |= last_mask;
+        }
+        if (level + 1 < levels.size()) {
+            set_range(first_word, last_word + 1, level + 1);
+        }
+    }
 
-        // We call the daemon once we've found the victim 
-        int num_instr_since_last = inst_count - daemon_clock;
-        if (num_instr_since_last >= 50) {
-            daemon_reset();
-            daemon_clock = inst_count;
+    void clear_all() {
+        for (size_t level = 0; level < levels.size(); level++) {
+            fill(levels[level].begin(), levels[level].end(), 0ULL);
         }
+    }
 
-        return victim_frame;
+    // Add all the frames of another bitmap of the same size. The summary of a union is the union of the summaries
+    void add_all(const FrameBitmap& other) {
+        for (size_t level = 0; level < levels.size(); level++) {
+            for (size_t w = 0; w < levels[level].size(); w++) {
+                levels[level][w] |= other.levels[level][w];
+            }
+        }
+    }
 
+    // First frame of the set >= from, -1 if none
+    int find_next(int from) {
+        size_t level = 0;
+        int pos = from;
+        // Climb until a word has a set bit at or after pos
+        while (true) {
+            if (pos >= num_bits[level]) {
+                return -1;
+            }
+            unsigned long long word = levels[level][pos >> 6] & (~0ULL << (pos & 63));
+            if (word != 0) {
+                pos = ((pos >> 6) << 6) + __builtin_ctzll(word);
+                break;
+            }
+            if (level + 1 == levels.size()) {
+                return -1;
+            }
+            pos = (pos >> 6) + 1;
+            level++;
+        }
+        // Go down to the first set bit under pos
+        while (level > 0) {
+            level--;
+            pos = (pos << 6) + __builtin_ctzll(levels[level][pos]);
+        }
+        return pos;
     }
 
+    // First frame of the set from position from, going around the end, -1 if the set is empty
+    int find_next_around(int from) {
+        int i = find_next(from);
+        if (i == -1 && from > 0) {
+            i = find_next(0);
+        }
+        return i;
+    }
 };
 
-class AGING: public Pager {
+// Doubly linked list of frames threaded through arrays indexed by the frame id, like the free pool,
+// so inserting, removing or moving a frame is O(1) without any allocation. The front is the oldest frame
+struct FrameList {
+    vector<int> prev;
+    vector<int> next;
+    vector<bool> linked;
+    int head;
+    int tail;
+    int size;
+
+    FrameList() {
+        prev.assign(sim->MAX_NUM_FRAMES, -1);
+        next.assign(sim->MAX_NUM_FRAMES, -1);
+        linked.assign(sim->MAX_NUM_FRAMES, false);
+        head = -1;
+        tail = -1;
+        size = 0;
+    }
 
-    PTE* get_pte_from_hand(int hand) {
-        Frame* frame = &frameTable[hand];
-        PTE* pte = frame->get_pte();
-        return pte;
+    bool contains(int fid) {
+        return linked[fid];
+    }
+
+    int front() {
+        return head;
+    }
+
+    void push_back(int fid) {
+        insert_after(tail, fid);
+    }
+
+    // Insert fid after the frame pos, at the front if pos is -1
+    void insert_after(int pos, int fid) {
+        int after = (pos == -1) ? head : next[pos];
+        prev[fid] = pos;
+        next[fid] = after;
+        if (pos == -1) {
+            head = fid;
+        } else {
+            next[pos] = fid;
+        }
+        if (after == -1) {
+            tail = fid;
+        } else {
+            prev[after] = fid;
+        }
+        linked[fid] = true;
+        size++;
+    }
+
+    void remove(int fid) {
+        if (prev[fid] == -1) {
+            head = next[fid];
+        } else {
+            next[prev[fid]] = next[fid];
+        }
+        if (next[fid] == -1) {
+            tail = prev[fid];
+        } else {
+            prev[next[fid]] = prev[fid];
+        }
+        prev[fid] = -1;
+        next[fid] = -1;
+        linked[fid] = false;
+        size--;
+    }
+
+    void remove_if_linked(int fid) {
+        if (linked[fid]) {
+            remove(fid);
+        }
+    }
+
+    int pop_front() {
+        int fid = head;
+        remove(fid);
+        return fid;
+    }
+};
+
+// Identity of a virtual page of a process, for the pagers remembering pages which are not in memory anymore
+unsigned long page_key(int pid, int vpage) {
+    return ((unsigned long) pid << 32) | (unsigned int) vpage;
+}
+
+unsigned long page_key(Frame* frame) {
+    return page_key(frame->process->pid, frame->vpage);
+}
+
+// A time (instruction or access number) per virtual page of every process, for the trace analyses.
+// In an array if all the address spaces fit, else in a hash table. Pages never set have the time none
+struct PageTimes {
+    bool dense;
+    unsigned int none;
+    vector<unsigned int> dense_times;
+    unordered_map<unsigned long, unsigned int> sparse_times;
+
+    PageTimes(unsigned int none_) {
+        none = none_;
+        dense = ((long) sim->NUM_PROCESSES * MAX_NUM_PTE <= (1L << 26));
+        if (dense) {
+            dense_times.assign((long) sim->NUM_PROCESSES * MAX_NUM_PTE, none);
+        }
+    }
+
+    unsigned int& at(int pid, int vpage) {
+        if (dense && pid >= 0 && pid < sim->NUM_PROCESSES && vpage >= 0 && vpage < MAX_NUM_PTE) {
+            return dense_times[(long) pid * MAX_NUM_PTE + vpage];
+        }
+        return sparse_times.insert(make_pair(page_key(pid, vpage), none)).first->second;
+    }
+};
+
+// "Ghost" list of recently evicted pages (only their identity), oldest at the front
+struct GhostList {
+    list<unsigned long> pages;
+    unordered_map<unsigned long, list<unsigned long>::iterator> positions;
+
+    int size() {
+        return (int) pages.size();
+    }
+
+    bool contains(unsigned long key) {
+        return positions.count(key) != 0;
+    }
+
+    void push_back(unsigned long key) {
+        pages.push_back(key);
+        positions[key] = --pages.end();
+    }
+
+    void remove(unsigned long key) {
+        unordered_map<unsigned long, list<unsigned long>::iterator>::iterator it = positions.find(key);
+        if (it == positions.end()) {
+            return;
+        }
+        pages.erase(it->second);
+        positions.erase(it);
     }
 
+    void pop_front() {
+        positions.erase(pages.front());
+        pages.pop_front();
+    }
+};
+
+//-------------------- STEP 8 : Create the different Pager Algorithms --------------------
+
+class FIFO final : public Pager {
+
+    public:
+
     // This function is called if the frame table is FULL (frameTable.size() == MAX_NUM_FRAMES)
     Frame* select_victim_frame() {
+        Frame* victim_frame = &sim->frameTable[hand];
+        hand = (hand + 1) % sim->MAX_NUM_FRAMES; 
+        // Only the reclaim daemon leaves free frames on the way
+        while (victim_frame->isFree) {
+            victim_frame = &sim->frameTable[hand];
+            hand = (hand + 1) % sim->MAX_NUM_FRAMES;
+        }
+        return victim_frame;
+    }
+
+};
+
+class CLOCK final : public Pager {
 
-        // First we age the frames' PTE 
-        for ( vector<Frame>::iterator it_frame = frameTable.begin(); it_frame != frameTable.end(); it_frame++ ) {
-            // shift age
-            it_frame->age = it_frame->age>>1;
+    // Frames whose page has its R bit at 0, so the hand jumps over the referenced ones in one search
+    FrameBitmap unreferenced;
 
-            // Check if referenced
-            PTE* pte = it_frame->get_pte();
-            if (pte->referenced) {
-                it_frame->age = (it_frame->age | 0x80000000); // set leading bit to 1
-                pte->referenced = 0; // reset R bit
+    // Reset the R bit of the frames in [from, to), all referenced or free
+    void clear_referenced(int from, int to) {
+        if (sim->numFreeFrames > 0) {
+            // Free frames left by the reclaim daemon : they must stay out of the search
+            for (int fid = from; fid < to; fid++) {
+                if (!sim->frameTable[fid].isFree) {
+                    sim->frameTable[fid].get_pte()->referenced = 0;
+                    unreferenced.set(fid);
+                }
             }
-            // else we do nothing, the leading bit is already 0 because of the shift
+            return;
+        }
+        for (int fid = from; fid < to; fid++) {
+            sim->frameTable[fid].get_pte()->referenced = 0;
         }
+        unreferenced.set_range(from, to);
+    }
 
-        // Now we pick the frame with the lowest age.
-        Frame* victim_frame = &frameTable[hand];
-        unsigned int min_age = victim_frame->age;
-        // Now we make a full clock turn and look for the youngest frame.
-        // In case of equality, we pick the first one relative to the hand counter we had in the beginning
-        int curr_hand = (hand + 1) % MAX_NUM_FRAMES;
-        Frame* curr_frame = 0;
-        
-        while ( curr_hand != hand ) {
-            curr_frame = &frameTable[curr_hand];
-            if (curr_frame->age < min_age) {
-                min_age = curr_frame->age;
-                victim_frame = curr_frame;
+    public:
+
+        CLOCK() : unreferenced(sim->MAX_NUM_FRAMES) {}
+
+        void on_map(Frame* frame) {
+            unreferenced.clear(frame->fid); // it's about to be referenced
+        }
+
+        void on_prefetch(Frame* frame) {
+            unreferenced.set(frame->fid);
+        }
+
+        void on_reference(Frame* frame) {
+            unreferenced.clear(frame->fid);
+        }
+
+        void on_free(Frame* frame) {
+            unreferenced.clear(frame->fid);
+        }
+
+    // This function is called if the frame table is FULL (frameTable.size() == MAX_NUM_FRAMES)
+    Frame* select_victim_frame() {
+
+        // The hand stops at the first page with referenced bit = 0. The referenced pages before it
+        // have their bit reset to 0 as the hand passes them
+        int victim_fid = unreferenced.find_next_around(hand);
+        if (victim_fid == -1) {
+            // Every page is referenced : the hand makes a full turn resetting them all and stops where it started,
+            // or on the next mapped frame
+            clear_referenced(0, sim->MAX_NUM_FRAMES);
+            victim_fid = unreferenced.find_next_around(hand);
+        } else if (victim_fid >= hand) {
+            clear_referenced(hand, victim_fid);
+        } else {
+            clear_referenced(hand, sim->MAX_NUM_FRAMES);
+            clear_referenced(0, victim_fid);
+        }
+        Frame* victim_frame = &(sim->frameTable[victim_fid]);
+
+        hand = (victim_fid + 1) % sim->MAX_NUM_FRAMES; // advance hand for next call
+
+        return victim_frame;
+    }
+
+};
+
+class EnhancedSecondChance final : public Pager {
+
+    // We define the class as 2*R + M just like in the lectures.
+    // Class of the page in each frame, and the frames of each class, so the first frame of a class from the hand
+    // is a bitmap search and the daemon moves whole classes at once
+    vector<int> classes;
+    vector<FrameBitmap> class_frames;
+
+    void set_class(int fid, int class_) {
+        class_frames[classes[fid]].clear(fid);
+        classes[fid] = class_;
+        class_frames[class_].set(fid);
+    }
+
+    void daemon_reset() {
+        // Only the mapped frames are in a class. Class 2 goes to 0 and 3 to 1
+        for (int class_ = 2; class_ < 4; class_++) {
+            for (int fid = class_frames[class_].find_next(0); fid != -1; fid = class_frames[class_].find_next(fid + 1)) {
+                sim->frameTable[fid].get_pte()->referenced = 0;
+                classes[fid] = class_ - 2;
             }
-            curr_hand = (curr_hand + 1) % MAX_NUM_FRAMES;
+            class_frames[class_ - 2].add_all(class_frames[class_]);
+            class_frames[class_].clear_all();
         }
+    }
 
-        // hand update for next function call -> We start at the frame after our victim
-        hand = (victim_frame->fid + 1) % MAX_NUM_FRAMES;
+    public:
+
+        EnhancedSecondChance() {
+            classes.assign(sim->MAX_NUM_FRAMES, 0);
+            class_frames.assign(4, FrameBitmap(sim->MAX_NUM_FRAMES));
+        }
+
+        void on_map(Frame* frame) {
+            // It's about to be referenced. M is reset by IN/FIN, kept by ZERO
+            set_class(frame->fid, 2 + frame->get_pte()->modified);
+        }
+
+        void on_prefetch(Frame* frame) {
+            set_class(frame->fid, 0); // not referenced, and M is reset by the prefetch
+        }
+
+        void on_reference(Frame* frame) {
+            set_class(frame->fid, classes[frame->fid] | 2);
+        }
+
+        void on_modify(Frame* frame) {
+            set_class(frame->fid, classes[frame->fid] | 1);
+        }
+
+        void on_free(Frame* frame) {
+            class_frames[classes[frame->fid]].clear(frame->fid);
+        }
+
+    // This function is called if the frame table is FULL (frameTable.size() == MAX_NUM_FRAMES)
+    Frame* select_victim_frame() {
+
+        // We look for the first frame of the lowest class, starting at the hand.
+        // If no frames exists in a class, we search for the next class
+        int victim_fid = -1;
+        for (int class_ = 0; class_ < 4 && victim_fid == -1; class_++ ) {
+            victim_fid = class_frames[class_].find_next_around(hand);
+        }
+        Frame* victim_frame = &sim->frameTable[victim_fid];
 
+        // last hand update for next function call
+        hand = (victim_fid + 1) % sim->MAX_NUM_FRAMES;
+
+        // We call the daemon once we've found the victim 
+        int num_instr_since_last = sim->inst_count - daemon_clock;
+        if (num_instr_since_last >= 50) {
+            daemon_reset();
+            daemon_clock = sim->inst_count;
+        }
 
         return victim_frame;
 
@@ -585,112 +2571,334 @@ class AGING: public Pager {
 
 };
 
-class WORKING_SET: public Pager {
+// AGING sweeping the whole frame table : every fault shifts the age of all the frames and scans them all
+// for the minimum. O(frames) per fault but on the packed ages and R bits with the vector kernels,
+// so it is the fastest for small frame tables. The indexed AGING below picks the same victims
+class AGING_SCAN final : public Pager {
 
-    PTE* get_pte_from_hand(int hand) {
-        Frame* frame = &frameTable[hand];
-        PTE* pte = frame->get_pte();
-        return pte;
-    }
+    FrameStateMirror frames;
 
-    // Check if a frame is eligible to be replaced
-    bool is_eligible(Frame* frame) {
-        PTE* pte = frame->get_pte();
+    public:
 
-        // If the pte was referenced, it's not eligible
-        if ( pte->referenced ) {
-            return false;
+        void on_map(Frame* frame) {
+            frames.map(frame, true);
         }
 
-        // If the pte was not referenced but its time since last R reset is < TAU, it's not eligible
-        if ( inst_count - 2 - frame->time_last_used < TAU ) {
-            return false;
+        void on_prefetch(Frame* frame) {
+            frames.map(frame, false);
         }
-        // If the pte was not referenced but its time since last R reset is >= TAU, it is eligible
-        else {
-            return true;
+
+        void on_reference(Frame* frame) {
+            frames.referenced[frame->fid] = 1;
         }
+
+    // This function is called if the frame table is FULL (frameTable.size() == MAX_NUM_FRAMES)
+    Frame* select_victim_frame() {
+
+        // First we age the frames : shift the age, set the leading bit of the referenced ones, then reset their R bit
+        frame_kernels.age_frames(&frames.ages[0], &frames.referenced[0], sim->MAX_NUM_FRAMES);
+        frames.clear_referenced();
+
+        // Now we pick the frame with the lowest age.
+        // In case of equality, we pick the first one relative to the hand counter we had in the beginning
+        unsigned int min_age = frame_kernels.min_age(&frames.ages[0], sim->MAX_NUM_FRAMES);
+        int victim_fid = frame_kernels.find_age(&frames.ages[0], hand, sim->MAX_NUM_FRAMES, min_age);
+        if (victim_fid == -1) {
+            victim_fid = frame_kernels.find_age(&frames.ages[0], 0, hand, min_age);
+        }
+        Frame* victim_frame = &sim->frameTable[victim_fid];
+
+        // hand update for next function call -> We start at the frame after our victim
+        hand = (victim_fid + 1) % sim->MAX_NUM_FRAMES;
+
+        return victim_frame;
+
     }
 
-    Frame* get_oldest_frame() {
-        // If no frame verifies the condition, we pick the oldest one
-        // 2 Cases : If all frames are referenced (R = 1) the oldest one is .. the oldest one (= global_oldest_frame)
-        //           If some frames are not referenced (R = 1) the oldest one is the oldest one among the unreferenced frames (= unref_oldest_frame)
-        Frame* global_oldest_frame =  &frameTable[hand]; 
-        int global_oldest_time = inst_count - global_oldest_frame->time_last_used;
+};
+
+// Up to this number of frames, -aa uses AGING_SCAN (see -baging)
+const int AGING_SCAN_MAX_FRAMES = 512;
+
+// AGING with lazy ageing and a min index, O(log frames) per fault instead of O(frames).
+// Each aging pass (one per call of select_victim_frame) is an epoch. The age of a frame is stored
+// with the epoch it was computed at, its current age is that value shifted by the epochs elapsed since.
+// Only the frames whose R bit was set since the last pass (reported by on_reference/on_map) have
+// their age recomputed at the next pass. The victims are exactly the ones of AGING_SCAN :
+// lowest age, ties broken by the first frame from the hand
+class AGING final : public Pager {
+
+    unsigned long epoch; // number of aging passes done
+    vector<unsigned int> ages; // age of each frame when last computed
+    vector<unsigned long> age_epochs; // epoch at which each age was computed
+    vector<int> referenced_frames; // frames which may have their R bit set since the last pass
+
+    // Segment tree over the frames : each node holds a frame of minimum age of its subtree.
+    // Shifting all the ages by the same amount keeps the order (maybe creating ties), so a node
+    // stays a minimum of its subtree until one of its frames is updated
+    int tree_size; // number of leaves, power of 2 >= MAX_NUM_FRAMES
+    vector<int> tree; // tree[1] is the root, leaves start at tree_size. -1 for empty leaves
+
+    public:
+
+        AGING() {
+            epoch = 0;
+            ages.assign(sim->MAX_NUM_FRAMES, 0);
+            age_epochs.assign(sim->MAX_NUM_FRAMES, 0);
+            tree_size = 1;
+            while (tree_size < sim->MAX_NUM_FRAMES) {
+                tree_size *= 2;
+            }
+            tree.assign(2 * tree_size, -1); // the frames enter the tree when they're mapped
+        }
+
+        // Age of a frame at a given epoch (not before the one it was computed at)
+        unsigned int age_at(int fid, unsigned long at_epoch) {
+            unsigned long elapsed = at_epoch - age_epochs[fid];
+            return (elapsed >= 32) ? 0 : ages[fid] >> elapsed;
+        }
+
+        // Age of a frame at the current epoch
+        unsigned int age(int fid) {
+            return age_at(fid, epoch);
+        }
+
+        int min_frame(int fid_a, int fid_b) {
+            if (fid_a == -1) {
+                return fid_b;
+            }
+            if (fid_b == -1) {
+                return fid_a;
+            }
+            return (age(fid_b) < age(fid_a)) ? fid_b : fid_a;
+        }
+
+        void set_age(int fid, unsigned int age_) {
+            ages[fid] = age_;
+            age_epochs[fid] = epoch;
+            for (int node = (tree_size + fid) / 2; node >= 1; node /= 2) {
+                tree[node] = min_frame(tree[2 * node], tree[2 * node + 1]);
+            }
+        }
+
+        // First frame in [from, to) of the subtree of node (covering [lo, hi)) with an age <= max_age, -1 if none
+        int find_first(int node, int lo, int hi, int from, int to, unsigned int max_age) {
+            if (hi <= from || to <= lo || tree[node] == -1 || age(tree[node]) > max_age) {
+                return -1;
+            }
+            if (hi - lo == 1) {
+                return tree[node];
+            }
+            int mid = (lo + hi) / 2;
+            int found = find_first(2 * node, lo, mid, from, to, max_age);
+            if (found == -1) {
+                found = find_first(2 * node + 1, mid, hi, from, to, max_age);
+            }
+            return found;
+        }
+
+        void on_map(Frame* frame) {
+            tree[tree_size + frame->fid] = frame->fid;
+            set_age(frame->fid, 0);
+            referenced_frames.push_back(frame->fid); // it's about to be referenced
+        }
+
+        void on_prefetch(Frame* frame) {
+            tree[tree_size + frame->fid] = frame->fid;
+            set_age(frame->fid, 0);
+        }
+
+        // A free frame leaves the tree until it's mapped again
+        void on_free(Frame* frame) {
+            tree[tree_size + frame->fid] = -1;
+            for (int node = (tree_size + frame->fid) / 2; node >= 1; node /= 2) {
+                tree[node] = min_frame(tree[2 * node], tree[2 * node + 1]);
+            }
+        }
+
+        void on_reference(Frame* frame) {
+            referenced_frames.push_back(frame->fid);
+        }
+
+        // This function is called if the frame table is FULL (frameTable.size() == MAX_NUM_FRAMES)
+        Frame* select_victim_frame() {
+
+            // Aging pass : the frames not referenced are shifted implicitly by the new epoch,
+            // the referenced ones get their leading bit set and their R bit reset
+            epoch++;
+            for (vector<int>::iterator it = referenced_frames.begin(); it != referenced_frames.end(); it++) {
+                PTE* pte = sim->frameTable[*it].get_pte();
+                if (pte != 0 && pte->referenced) { // freed frames have no PTE
+                    unsigned int previous_age = age_at(*it, epoch - 1);
+                    set_age(*it, (previous_age >> 1) | 0x80000000);
+                    pte->referenced = 0;
+                }
+            }
+            referenced_frames.clear();
+
+            // The youngest age, and the first frame from the hand having it
+            unsigned int min_age = age(tree[1]);
+            int victim_fid = find_first(1, 0, tree_size, hand, sim->MAX_NUM_FRAMES, min_age);
+            if (victim_fid == -1) {
+                victim_fid = find_first(1, 0, tree_size, 0, hand, min_age);
+            }
+            Frame* victim_frame = &sim->frameTable[victim_fid];
+
+            // hand update for next function call -> We start at the frame after our victim
+            hand = (victim_frame->fid + 1) % sim->MAX_NUM_FRAMES;
+
+            return victim_frame;
+        }
+
+};
 
-        Frame* unref_oldest_frame = 0;
-        int unref_oldest_time = -1;
-        PTE* pte = frameTable[hand].get_pte();
-        if (pte->referenced == 0) {
-            unref_oldest_frame = &frameTable[hand];
-            unref_oldest_time = inst_count - unref_oldest_frame->time_last_used;
+class WORKING_SET final : public Pager {
+
+    // The frames are indexed so the hand never walks the frame table frame by frame :
+    //  - referenced : frames with R = 1, reset in bulk when the hand passes them
+    //  - eligible : frames with R = 0 and not used for TAU instructions or more
+    //  - waiting : (time_last_used, fid) of the frames with R = 0 not eligible yet, oldest first. The time of use
+    //    only takes increasing values so a FIFO is enough. Entries of frames referenced since then are skipped
+    //  - tree : segment tree of the minimum time_last_used, to get the oldest frame when none is eligible.
+    //    It's only needed after a full clock turn, which resets all the referenced frames, so only the times
+    //    set by the resets are kept, and the tree is brought up to date when it's used
+    FrameBitmap referenced;
+    FrameBitmap eligible;
+    queue< pair<int, int> > waiting;
+    int tree_size; // number of leaves, power of 2 >= MAX_NUM_FRAMES
+    vector<int> tree; // tree[1] is the root, leaves start at tree_size
+    vector<int> stale_leaves; // frames whose leaf changed since the tree was last updated
+
+    void update_tree() {
+        if ((int) stale_leaves.size() > tree_size / 16) {
+            // Cheaper to rebuild all of it
+            for (int node = tree_size - 1; node >= 1; node--) {
+                tree[node] = min(tree[2 * node], tree[2 * node + 1]);
+            }
         } else {
-            unref_oldest_frame = 0;
-            unref_oldest_time = -1;
-        }
-        // loop to find the oldest frame
-        int start_hand = hand;
-        hand = (hand + 1) % MAX_NUM_FRAMES;
-
-        while ( hand != start_hand ) {
-
-            Frame* frame = &frameTable[hand];
-            int time = inst_count - frame->time_last_used;
-            if (time > global_oldest_time) {
-                global_oldest_frame = frame;
-                global_oldest_time = time;
-            }
-            
-            PTE* pte = frame->get_pte();
-            if ( pte->referenced == 0 ) {
-                if ( unref_oldest_frame == 0 || time > unref_oldest_time) {
-                    unref_oldest_frame = frame;
-                    unref_oldest_time = time;
+            for (vector<int>::iterator it = stale_leaves.begin(); it != stale_leaves.end(); it++) {
+                for (int node = (tree_size + *it) / 2; node >= 1; node /= 2) {
+                    tree[node] = min(tree[2 * node], tree[2 * node + 1]);
                 }
             }
-            hand = (hand + 1) % MAX_NUM_FRAMES;
         }
-        // We return the unref_oldest_time if it exists, else the global_oldest_frame
-        if ( unref_oldest_frame == 0 ) {
-            return global_oldest_frame;
+        stale_leaves.clear();
+    }
+
+    // First frame in [from, to) of the subtree of node (covering [lo, hi)) with a time <= max_time, -1 if none
+    int find_first(int node, int lo, int hi, int from, int to, int max_time) {
+        if (hi <= from || to <= lo || tree[node] > max_time) {
+            return -1;
         }
-        else {
-            return unref_oldest_frame;
+        if (hi - lo == 1) {
+            return lo;
+        }
+        int mid = (lo + hi) / 2;
+        int found = find_first(2 * node, lo, mid, from, to, max_time);
+        if (found == -1) {
+            found = find_first(2 * node + 1, mid, hi, from, to, max_time);
         }
+        return found;
+    }
 
+    // The hand passes the frames in [from, to) : the referenced ones get their R bit reset and their time updated
+    void reset_referenced(int from, int to) {
+        int time = sim->inst_count - 1;
+        int fid = referenced.find_next(from);
+        while (fid != -1 && fid < to) {
+            sim->frameTable[fid].get_pte()->referenced = 0;
+            sim->frameTable[fid].time_last_used = time;
+            referenced.clear(fid);
+            tree[tree_size + fid] = time;
+            stale_leaves.push_back(fid);
+            waiting.push(make_pair(time, fid));
+            fid = referenced.find_next(fid + 1);
+        }
     }
 
-    // This function is called if the frame table is FULL (frameTable.size() == MAX_NUM_FRAMES)
-    Frame* select_victim_frame() {
-        
-        Frame* victim_frame = &frameTable[hand];
+    // A frame is eligible if it's not referenced and its time since last R reset is >= TAU
+    void update_eligible() {
+        long last_eligible_time = (long) sim->inst_count - 2 - TAU;
+        while (!waiting.empty() && waiting.front().first <= last_eligible_time) {
+            int fid = waiting.front().second;
+            if (sim->frameTable[fid].time_last_used == waiting.front().first && !referenced.test(fid)) {
+                eligible.set(fid);
+            }
+            waiting.pop();
+        }
+    }
 
-        // We go through the frame list to find the frist eligible frame + we update the ref bits
-        int num_scan = 0;
-        while ( !is_eligible(victim_frame) && num_scan != MAX_NUM_FRAMES ) {
-            num_scan++; // TODELETE
-            // If the reference bit is set, we reset it and update the time of the frame
-            PTE* pte = victim_frame->get_pte();
+    void set_referenced(int fid) {
+        if (!referenced.test(fid)) {
+            referenced.set(fid);
+            eligible.clear(fid);
+        }
+    }
+
+    public:
 
-            if ( pte->referenced ) {
-                pte->referenced = 0;
-                victim_frame->time_last_used = inst_count - 1;
+        WORKING_SET() : referenced(sim->MAX_NUM_FRAMES), eligible(sim->MAX_NUM_FRAMES) {
+            tree_size = 1;
+            while (tree_size < sim->MAX_NUM_FRAMES) {
+                tree_size *= 2;
             }
-            // Increment hand
-            hand = (hand + 1) % MAX_NUM_FRAMES;
-            victim_frame = &frameTable[hand];
+            tree.assign(2 * tree_size, 0x7fffffff); // the leaves past the last frame are never the oldest
         }
 
-        // Check if we made a full clock turn without finding an eligible frame
-        // If that's the case, we select the oldest frame
-        if (num_scan == MAX_NUM_FRAMES) {
-            // If full clock turn, we pick the oldest frame
-            victim_frame = get_oldest_frame();
+        void on_map(Frame* frame) {
+            // It's about to be referenced. Its time of use was set by the map
+            set_referenced(frame->fid);
         }
 
+        // Not referenced : it waits to become eligible from its time of map, and it's in the tree with that time
+        void on_prefetch(Frame* frame) {
+            referenced.clear(frame->fid);
+            eligible.clear(frame->fid);
+            waiting.push(make_pair(frame->time_last_used, frame->fid));
+            tree[tree_size + frame->fid] = frame->time_last_used;
+            stale_leaves.push_back(frame->fid);
+        }
+
+        void on_reference(Frame* frame) {
+            set_referenced(frame->fid);
+        }
+
+        // A free frame is in no index : its waiting entries don't match its time anymore, and it's never the oldest
+        void on_free(Frame* frame) {
+            referenced.clear(frame->fid);
+            eligible.clear(frame->fid);
+            frame->time_last_used = -1;
+            tree[tree_size + frame->fid] = 0x7fffffff;
+            stale_leaves.push_back(frame->fid);
+        }
+
+    // This function is called if the frame table is FULL (frameTable.size() == MAX_NUM_FRAMES)
+    Frame* select_victim_frame() {
+
+        // We look for the first eligible frame from the hand, resetting the referenced frames on the way
+        update_eligible();
+        int victim_fid = eligible.find_next_around(hand);
+        if (victim_fid >= hand) {
+            reset_referenced(hand, victim_fid);
+        } else if (victim_fid != -1) {
+            reset_referenced(hand, sim->MAX_NUM_FRAMES);
+            reset_referenced(0, victim_fid);
+        } else {
+            // Full clock turn without an eligible frame : all the frames are reset, and we pick the oldest one.
+            // In case of equality, we pick the first one from the hand
+            reset_referenced(hand, sim->MAX_NUM_FRAMES);
+            reset_referenced(0, hand);
+            update_tree();
+            int oldest_time = tree[1];
+            victim_fid = find_first(1, 0, tree_size, hand, sim->MAX_NUM_FRAMES, oldest_time);
+            if (victim_fid == -1) {
+                victim_fid = find_first(1, 0, tree_size, 0, hand, oldest_time);
+            }
+        }
+        Frame* victim_frame = &sim->frameTable[victim_fid];
+
         // hand update for next function call -> We start at the frame after our victim
-        hand = (victim_frame->fid + 1) % MAX_NUM_FRAMES;
+        hand = (victim_fid + 1) % sim->MAX_NUM_FRAMES;
 
         return victim_frame;
 
@@ -698,9 +2906,9 @@ class WORKING_SET: public Pager {
 
 };
 
-class RANDOM: public Pager {
+class RANDOM final : public Pager {
     public :
-        int* random_nums; // This array will store all the random numbers
+        vector<int> random_nums; // This array will store all the random numbers
         int total_random_num;
         int ofs;
 
@@ -711,22 +2919,36 @@ class RANDOM: public Pager {
 
         void initialize_random_array(istream& rand_file){
 
+            total_random_num = 0;
             rand_file >> total_random_num; // Read first line where there is the total number of random numbers
 
-            random_nums = new int[total_random_num] ;
+            // The random numbers come from the caller of the library : we never read more than the first line
+            // says, and we only use the ones we could read
             int curr_num;
-            int incr = 0;
-            while (rand_file >> curr_num) {
-                random_nums[incr] = curr_num;
-                incr++;
+            while ((int) random_nums.size() < total_random_num && rand_file >> curr_num) {
+                random_nums.push_back(curr_num);
             }
+            total_random_num = random_nums.size();
+
+        }
 
+        // The victims are picked with random numbers % frames : they must be there and not be negative
+        bool valid_random_numbers() {
+            if (random_nums.empty()) {
+                return false;
+            }
+            for (vector<int>::iterator it = random_nums.begin(); it != random_nums.end(); it++) {
+                if (*it < 0) {
+                    return false;
+                }
+            }
+            return true;
         }
 
 
         int get_random_number() { 
 
-            int randomVal = random_nums[ofs] % MAX_NUM_FRAMES;
+            int randomVal = random_nums[ofs] % sim->MAX_NUM_FRAMES;
             ofs++;
             if (ofs == total_random_num) {
                 ofs = 0;
@@ -739,7 +2961,12 @@ class RANDOM: public Pager {
         // This function is called if the frame table is FULL (frameTable.size() == MAX_NUM_FRAMES)
         Frame* select_victim_frame() {
             int random_frame_id = get_random_number();
-            Frame* victim_frame = &frameTable[random_frame_id];
+            // The reclaim daemon can leave so few frames mapped that the random numbers never hit one of them :
+            // we take the first mapped frame from the random one
+            while (sim->frameTable[random_frame_id].isFree) {
+                random_frame_id = (random_frame_id + 1) % sim->MAX_NUM_FRAMES;
+            }
+            Frame* victim_frame = &sim->frameTable[random_frame_id];
             //hand = (hand + 1) % MAX_NUM_FRAMES; 
             return victim_frame;
         }
@@ -747,272 +2974,2952 @@ class RANDOM: public Pager {
 };
 
 
-//-------------------- STEP 9 : Create the Simulator --------------------
+// Exact LRU : the frames are kept in the order of their last access, the least recently used one is the victim
+class LRU final : public Pager {
 
-struct Simulator {
+    FrameList frames; // least recently used first
 
-    Pager* pager; // pointer to Pager algorithm
-    Process* curr_process; // pointer to current process
+    public:
 
-    Simulator(Pager* pager_) {
-        pager = pager_;
-        curr_process = 0;
-    }
+        LRU() {
+            tracks_accesses = true;
+        }
 
-    Frame* get_frame() {
-        Frame* new_frame = allocate_frame_from_free_list();
-        if (new_frame == 0) {
+        void on_map(Frame* frame) {
+            frames.remove_if_linked(frame->fid);
+            frames.push_back(frame->fid);
+        }
+
+        void on_access(Frame* frame) {
+            frames.remove(frame->fid);
+            frames.push_back(frame->fid);
+        }
+
+        void on_free(Frame* frame) {
+            frames.remove(frame->fid);
+        }
+
+        Frame* select_victim_frame() {
+            return &sim->frameTable[frames.front()];
+        }
+
+};
+
+// Approximate LRU : each access only records its time, and the victim is the least recently used
+// of a few frames drawn at random. O(1) per access and per fault whatever the number of frames
+class LRU_APPROX final : public Pager {
+
+    vector<unsigned long> last_access;
+    unsigned int seed;
+
+    static const int NUM_SAMPLES = 8;
+
+    unsigned int next_random() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    public:
+
+        LRU_APPROX() {
+            tracks_accesses = true;
+            last_access.assign(sim->MAX_NUM_FRAMES, 0);
+            seed = 42;
+        }
+
+        void on_access(Frame* frame) {
+            last_access[frame->fid] = sim->inst_count;
+        }
+
+        Frame* select_victim_frame() {
+            int victim_fid = next_random() % sim->MAX_NUM_FRAMES;
+            while (sim->frameTable[victim_fid].isFree) {
+                victim_fid = next_random() % sim->MAX_NUM_FRAMES; // left free by the reclaim daemon
+            }
+            for (int sample = 1; sample < NUM_SAMPLES; sample++) {
+                int fid = next_random() % sim->MAX_NUM_FRAMES;
+                if (!sim->frameTable[fid].isFree && last_access[fid] < last_access[victim_fid]) {
+                    victim_fid = fid;
+                }
+            }
+            return &sim->frameTable[victim_fid];
+        }
+
+};
+
+// LFU with O(1) operations : the frames are kept in one list sorted by access count, least recently used
+// first among the frames with the same count, and we remember the last frame of each count.
+// An access moves the frame right after the last frame of its new count. The count starts at the map
+class LFU final : public Pager {
+
+    FrameList frames; // least frequently used first
+    vector<unsigned long> counts;
+    unordered_map<unsigned long, int> last_of_count; // last frame in the list with each count
+
+    // Take the frame out of the list, keeping last_of_count right
+    void unlink(int fid) {
+        unordered_map<unsigned long, int>::iterator last = last_of_count.find(counts[fid]);
+        if (last->second == fid) {
+            int before = frames.prev[fid];
+            if (before != -1 && counts[before] == counts[fid]) {
+                last->second = before;
+            } else {
+                last_of_count.erase(last);
+            }
+        }
+        frames.remove(fid);
+    }
+
+    // Put the frame after the last frame with a count <= its count, given the last frame with a lower count
+    void link(int fid, int last_lower) {
+        unordered_map<unsigned long, int>::iterator last = last_of_count.find(counts[fid]);
+        frames.insert_after((last == last_of_count.end()) ? last_lower : last->second, fid);
+        last_of_count[counts[fid]] = fid;
+    }
+
+    public:
+
+        LFU() {
+            tracks_accesses = true;
+            counts.assign(sim->MAX_NUM_FRAMES, 0);
+        }
+
+        void on_map(Frame* frame) {
+            if (frames.contains(frame->fid)) {
+                unlink(frame->fid);
+            }
+            counts[frame->fid] = 0;
+            link(frame->fid, -1);
+        }
+
+        void on_access(Frame* frame) {
+            int fid = frame->fid;
+            // The frames with the current count before fid stay in place, fid goes after them and after fid itself
+            int last_lower = last_of_count[counts[fid]];
+            if (last_lower == fid) {
+                last_lower = frames.prev[fid];
+            }
+            unlink(fid);
+            counts[fid]++;
+            link(fid, last_lower);
+        }
+
+        void on_free(Frame* frame) {
+            unlink(frame->fid);
+        }
+
+        Frame* select_victim_frame() {
+            return &sim->frameTable[frames.front()];
+        }
+
+};
+
+// ARC (Megiddo & Modha) : T1 holds the pages seen once recently, T2 the pages seen at least twice, both in LRU order.
+// B1 and B2 remember the pages evicted from T1 and T2. A fault on a page of B1 means T1 is too small, so
+// its target size p grows, a fault on a page of B2 makes it shrink
+class ARC final : public Pager {
+
+    FrameList t1;
+    FrameList t2;
+    GhostList b1;
+    GhostList b2;
+    int p; // target size of T1
+    bool fault_in_b2; // the page faulting is in B2
+    bool to_t2; // the page faulting goes to T2 (it was in B1 or B2)
+    bool discard_victim; // the next victim is dropped without being remembered in B1
+    int just_mapped; // frame mapped by the current fault, its first access is not a hit
+
+    public:
+
+        ARC() {
+            tracks_accesses = true;
+            p = 0;
+            fault_in_b2 = false;
+            to_t2 = false;
+            discard_victim = false;
+            just_mapped = -1;
+        }
+
+        void on_fault(Process* process, int vpage) {
+            int c = sim->MAX_NUM_FRAMES;
+            unsigned long key = page_key(process->pid, vpage);
+            fault_in_b2 = false;
+            to_t2 = false;
+            discard_victim = false;
+            if (b1.contains(key)) {
+                p = min(p + max(b2.size() / b1.size(), 1), c);
+                b1.remove(key);
+                to_t2 = true;
+            } else if (b2.contains(key)) {
+                p = max(p - max(b1.size() / b2.size(), 1), 0);
+                b2.remove(key);
+                to_t2 = true;
+                fault_in_b2 = true;
+            } else if (t1.size + b1.size() == c) {
+                if (t1.size < c) {
+                    b1.pop_front();
+                } else {
+                    discard_victim = true; // B1 is empty and T1 is the whole memory
+                }
+            } else if (t1.size + t2.size + b1.size() + b2.size() >= 2 * c && b2.size() > 0) {
+                b2.pop_front();
+            }
+        }
+
+        Frame* select_victim_frame() {
+            int victim_fid;
+            if (t1.size > 0 && (t1.size > p || (fault_in_b2 && t1.size == p) || t2.size == 0)) {
+                victim_fid = t1.pop_front();
+                if (!discard_victim) {
+                    b1.push_back(page_key(&sim->frameTable[victim_fid]));
+                }
+            } else {
+                victim_fid = t2.pop_front();
+                b2.push_back(page_key(&sim->frameTable[victim_fid]));
+            }
+            return &sim->frameTable[victim_fid];
+        }
+
+        void on_map(Frame* frame) {
+            t1.remove_if_linked(frame->fid);
+            t2.remove_if_linked(frame->fid);
+            if (to_t2) {
+                t2.push_back(frame->fid);
+            } else {
+                t1.push_back(frame->fid);
+            }
+            just_mapped = frame->fid;
+        }
+
+        // The selection remembered the page in B1 or B2 (or dropped it, from T1) : it goes back where it was
+        void on_keep(Frame* frame) {
+            unsigned long key = page_key(frame);
+            if (b2.contains(key)) {
+                b2.remove(key);
+                t2.push_back(frame->fid);
+            } else {
+                b1.remove(key);
+                t1.push_back(frame->fid);
+            }
+        }
+
+        void on_access(Frame* frame) {
+            if (frame->fid == just_mapped) {
+                just_mapped = -1;
+                return;
+            }
+            // The first access to a prefetched page is its first use, not a hit
+            if (frame->prefetched) {
+                return;
+            }
+            // Hit : the page goes to the most recent end of T2
+            if (t1.contains(frame->fid)) {
+                t1.remove(frame->fid);
+            } else {
+                t2.remove(frame->fid);
+            }
+            t2.push_back(frame->fid);
+        }
+
+        void on_free(Frame* frame) {
+            t1.remove_if_linked(frame->fid);
+            t2.remove_if_linked(frame->fid);
+        }
+
+};
+
+// CAR, Clock with Adaptive Replacement (Bansal & Modha) : ARC where T1 and T2 are clocks of frames with a
+// reference bit instead of LRU lists, so a hit only sets a bit. The referenced frames the hand of T1 passes
+// go to T2, the ones the hand of T2 passes get a second chance in T2
+class CAR final : public Pager {
+
+    FrameList t1; // the front is the position of the hand
+    FrameList t2;
+    GhostList b1;
+    GhostList b2;
+    vector<bool> referenced; // reference bit of CAR, not set by the access of the fault
+    int p; // target size of T1
+    bool in_b1; // the page faulting is in B1
+    bool in_b2; // the page faulting is in B2
+    int just_mapped;
+
+    public:
+
+        CAR() {
+            tracks_accesses = true;
+            referenced.assign(sim->MAX_NUM_FRAMES, false);
+            p = 0;
+            in_b1 = false;
+            in_b2 = false;
+            just_mapped = -1;
+        }
+
+        void on_fault(Process* process, int vpage) {
+            unsigned long key = page_key(process->pid, vpage);
+            in_b1 = b1.contains(key);
+            in_b2 = b2.contains(key);
+        }
+
+        Frame* select_victim_frame() {
+            int c = sim->MAX_NUM_FRAMES;
+            int victim_fid = -1;
+            while (victim_fid == -1) {
+                if (t1.size >= max(1, p) || t2.size == 0) {
+                    int fid = t1.pop_front();
+                    if (!referenced[fid]) {
+                        victim_fid = fid;
+                        b1.push_back(page_key(&sim->frameTable[fid]));
+                    } else {
+                        referenced[fid] = false;
+                        t2.push_back(fid);
+                    }
+                } else {
+                    int fid = t2.pop_front();
+                    if (!referenced[fid]) {
+                        victim_fid = fid;
+                        b2.push_back(page_key(&sim->frameTable[fid]));
+                    } else {
+                        referenced[fid] = false;
+                        t2.push_back(fid);
+                    }
+                }
+            }
+            // Keep the history at the size of the memory
+            if (!in_b1 && !in_b2) {
+                if (t1.size + b1.size() >= c) {
+                    b1.pop_front();
+                } else if (t1.size + t2.size + b1.size() + b2.size() >= 2 * c && b2.size() > 0) {
+                    b2.pop_front();
+                }
+            }
+            return &sim->frameTable[victim_fid];
+        }
+
+        void on_map(Frame* frame) {
+            int c = sim->MAX_NUM_FRAMES;
+            unsigned long key = page_key(frame);
+            t1.remove_if_linked(frame->fid);
+            t2.remove_if_linked(frame->fid);
+            if (in_b1) {
+                p = min(p + max(1, b2.size() / b1.size()), c);
+                b1.remove(key);
+                t2.push_back(frame->fid);
+            } else if (in_b2) {
+                p = max(p - max(1, b1.size() / b2.size()), 0);
+                b2.remove(key);
+                t2.push_back(frame->fid);
+            } else {
+                t1.push_back(frame->fid);
+            }
+            referenced[frame->fid] = false;
+            just_mapped = frame->fid;
+        }
+
+        // Same for CAR, behind the hand of its clock
+        void on_keep(Frame* frame) {
+            unsigned long key = page_key(frame);
+            if (b2.contains(key)) {
+                b2.remove(key);
+                t2.push_back(frame->fid);
+            } else {
+                b1.remove(key);
+                t1.push_back(frame->fid);
+            }
+            referenced[frame->fid] = false;
+        }
+
+        void on_access(Frame* frame) {
+            if (frame->fid == just_mapped) {
+                just_mapped = -1;
+                return;
+            }
+            if (frame->prefetched) {
+                return; // first use of a prefetched page, not a hit
+            }
+            referenced[frame->fid] = true;
+        }
+
+        void on_free(Frame* frame) {
+            t1.remove_if_linked(frame->fid);
+            t2.remove_if_linked(frame->fid);
+        }
+
+};
+
+// 2Q (Johnson & Shasha, full version) : a page seen for the first time goes to the FIFO A1in. When it leaves A1in
+// it is remembered in A1out, and only a page faulting again while in A1out goes to the LRU list Am.
+// Pages used once don't push the often used pages out of Am
+class TWO_Q final : public Pager {
+
+    FrameList a1in; // FIFO, oldest first
+    FrameList am; // LRU, least recently used first
+    GhostList a1out;
+    int kin; // target size of A1in
+    int kout; // size of A1out
+    bool to_am; // the page faulting goes to Am (it was in A1out)
+
+    public:
+
+        TWO_Q() {
+            tracks_accesses = true;
+            kin = max(sim->MAX_NUM_FRAMES / 4, 1);
+            kout = max(sim->MAX_NUM_FRAMES / 2, 1);
+            to_am = false;
+        }
+
+        void on_fault(Process* process, int vpage) {
+            unsigned long key = page_key(process->pid, vpage);
+            to_am = a1out.contains(key);
+            if (to_am) {
+                a1out.remove(key);
+            }
+        }
+
+        Frame* select_victim_frame() {
+            int victim_fid;
+            if (a1in.size > kin || am.size == 0) {
+                victim_fid = a1in.pop_front();
+                a1out.push_back(page_key(&sim->frameTable[victim_fid]));
+                if (a1out.size() > kout) {
+                    a1out.pop_front();
+                }
+            } else {
+                victim_fid = am.pop_front();
+            }
+            return &sim->frameTable[victim_fid];
+        }
+
+        void on_map(Frame* frame) {
+            a1in.remove_if_linked(frame->fid);
+            am.remove_if_linked(frame->fid);
+            if (to_am) {
+                am.push_back(frame->fid);
+            } else {
+                a1in.push_back(frame->fid);
+            }
+        }
+
+        // A victim of A1in was remembered in A1out, a victim of Am wasn't
+        void on_keep(Frame* frame) {
+            unsigned long key = page_key(frame);
+            if (a1out.contains(key)) {
+                a1out.remove(key);
+                a1in.push_back(frame->fid);
+            } else {
+                am.push_back(frame->fid);
+            }
+        }
+
+        void on_access(Frame* frame) {
+            // Hits in A1in don't change anything
+            if (am.contains(frame->fid)) {
+                am.remove(frame->fid);
+                am.push_back(frame->fid);
+            }
+        }
+
+        void on_free(Frame* frame) {
+            a1in.remove_if_linked(frame->fid);
+            am.remove_if_linked(frame->fid);
+        }
+
+};
+
+// Index of the next use of each instruction's page, for OPT : next_use[i] is the id of the next instruction
+// accessing the page accessed by instruction i, NO_NEXT_USE if there is none (or if i is not an access).
+// One pass over the trace, remembering the last access of each page : when a page is accessed again,
+// we fill the next use of its previous access. The reader must have read the processes already
+const unsigned int NO_NEXT_USE = 0xffffffff;
+
+void build_next_use_index(InstructionReader* reader, vector<unsigned int>& next_use) {
+    PageTimes last_access (NO_NEXT_USE);
+    int pid = 0;
+    Instruction instr;
+    while (reader->next(instr)) {
+        unsigned int iid = next_use.size();
+        next_use.push_back(NO_NEXT_USE);
+        if (instr.command == 'c') {
+            pid = instr.arg;
+            continue;
+        }
+        if (instr.command != 'r' && instr.command != 'w') {
+            continue;
+        }
+        unsigned int& last = last_access.at(pid, instr.arg);
+        if (last != NO_NEXT_USE) {
+            next_use[last] = iid;
+        }
+        last = iid;
+    }
+}
+
+// Belady's OPT : the victim is the frame whose page is used again the farthest in the future.
+// Each access gives the next use of its frame, and the frames are kept in a max heap of their next use.
+// The heap entries of the frames accessed since they were pushed are skipped when they reach the top
+class OPT final : public Pager {
+
+    vector<unsigned int> next_use; // see build_next_use_index
+    vector<unsigned int> frame_next_use; // next use of the page in each frame, 0 if not known
+    priority_queue< pair<unsigned int, int> > heap; // (next use, fid)
+
+    // Drop the outdated entries once they take too much room
+    void compact_heap() {
+        priority_queue< pair<unsigned int, int> > fresh;
+        for (int fid = 0; fid < sim->MAX_NUM_FRAMES; fid++) {
+            if (frame_next_use[fid] != 0) {
+                fresh.push(make_pair(frame_next_use[fid], fid));
+            }
+        }
+        heap.swap(fresh);
+    }
+
+    public:
+
+        OPT(vector<unsigned int>& next_use_) {
+            tracks_accesses = true;
+            next_use.swap(next_use_);
+            frame_next_use.assign(sim->MAX_NUM_FRAMES, 0);
+        }
+
+        void on_access(Frame* frame) {
+            // inst_count was incremented for the current instruction
+            frame_next_use[frame->fid] = next_use[sim->inst_count - 1];
+            heap.push(make_pair(frame_next_use[frame->fid], frame->fid));
+            if ((int) heap.size() > 4 * sim->MAX_NUM_FRAMES + 1024) {
+                compact_heap();
+            }
+        }
+
+        void on_free(Frame* frame) {
+            frame_next_use[frame->fid] = 0;
+        }
+
+        Frame* select_victim_frame() {
+            while (heap.top().first != frame_next_use[heap.top().second]) {
+                heap.pop();
+            }
+            int victim_fid = heap.top().second;
+            heap.pop();
+            frame_next_use[victim_fid] = 0;
+            return &sim->frameTable[victim_fid];
+        }
+
+};
+
+// OPT needs to read the trace before the simulation : we read it a first time with its own reader.
+// Returns 0 and sets error if the trace can't be read twice
+Pager* create_opt(const TraceSource& trace, string& error) {
+    ifstream input_file;
+    InstructionReader* reader = reopen_trace(trace, input_file, error);
+    if (reader == 0) {
+        return 0;
+    }
+    // The processes read again are thrown away, the simulation uses the ones already read
+    vector<Process> simulated_processes;
+    simulated_processes.swap(sim->processes);
+    reader->read_processes();
+    vector<unsigned int> next_use;
+    build_next_use_index(reader, next_use);
+    simulated_processes.swap(sim->processes);
+    delete reader;
+    return new OPT(next_use);
+}
+
+
+// Pager selected by -a : the original algorithms by their letter, the others by their name.
+// Returns 0 and sets error if there is no such algorithm or if it can't be used on the trace
+Pager* create_pager(const char* name, istream& rand_file, const TraceSource& trace, string& error) {
+    string name_str (name);
+    if (name_str.size() == 1) {
+        switch (tolower(name_str[0])) {
+            case 'f' : {
+                return new FIFO();
+            }
+            case 'c' : {
+                return new CLOCK();
+            }
+            case 'e' : {
+                return new EnhancedSecondChance();
+            }
+            case 'a' : {
+                // Both give the same victims, the vectorised sweep is faster until the index pays off.
+                // The sweep ages all the frames, so it can't be used when the reclaim daemon leaves free frames
+                if (sim->MAX_NUM_FRAMES <= AGING_SCAN_MAX_FRAMES && sim->RECLAIM_LOW == 0) {
+                    return new AGING_SCAN();
+                }
+                return new AGING();
+            }
+            case 'w' : {
+                return new WORKING_SET();
+            }
+            case 'r' : {
+                RANDOM* pager = new RANDOM(rand_file);
+                if (!pager->valid_random_numbers()) {
+                    delete pager;
+                    error = "The algorithm r needs random numbers >= 0 after their count.";
+                    return 0;
+                }
+                return pager;
+            }
+        }
+    }
+    if (name_str == "lru") {
+        return new LRU();
+    }
+    if (name_str == "lru_approx") {
+        return new LRU_APPROX();
+    }
+    if (name_str == "lfu") {
+        return new LFU();
+    }
+    if (name_str == "arc") {
+        return new ARC();
+    }
+    if (name_str == "car") {
+        return new CAR();
+    }
+    if (name_str == "2q") {
+        return new TWO_Q();
+    }
+    if (name_str == "opt") {
+        return create_opt(trace, error);
+    }
+    error = "Could not use the algorithm `" + name_str
+            + "'. Use f, r, c, e, a, w or one of lru, lru_approx, lfu, arc, car, 2q, opt.";
+    return 0;
+}
+//-------------------- STEP 9 : Create the Simulator --------------------
+// The simulator is specialized for the type of its pager : with a final pager class every call to the pager
+// is resolved at compile time and can be inlined in the fault path. Simulator<Pager> is the generic version,
+// through virtual calls
+
+// Locks of the SMP mode (-s), a big reader lock : every simulated CPU has its mutex on cache lines of its own.
+// A CPU takes its own mutex for what only touches its processes (context switches, reads and writes which
+// don't change any R or M bit), so the CPUs run these at the same time without sharing anything.
+// Everything the pager or the other CPUs can see (faults, pager hooks, exits) is done holding all the mutexes,
+// taken in order : the pagers scan the frames and the PTEs of every process, so they must run alone.
+// The counters of each CPU live next to its mutex
+struct SmpCpus {
+
+    struct Cpu {
+        char pad0[64];
+        mutex lock;
+        MmuCpuResults stats;
+        char pad1[64];
+    };
+
+    vector<Cpu> cpus;
+
+    SmpCpus(int num_cpus) : cpus(num_cpus) {}
+
+    void lock_cpu(int cpu_id) {
+        Cpu& cpu = cpus[cpu_id];
+        if (!cpu.lock.try_lock()) {
+            cpu.stats.lock_waits++; // a CPU holding all the locks
+            cpu.lock.lock();
+        }
+    }
+
+    void unlock_cpu(int cpu_id) {
+        cpus[cpu_id].lock.unlock();
+    }
+
+    // Stop all the CPUs. cpu_id must not hold its own lock
+    void lock_all(int cpu_id) {
+        bool waited = false;
+        for (vector<Cpu>::iterator it_cpu = cpus.begin(); it_cpu != cpus.end(); it_cpu++) {
+            if (!it_cpu->lock.try_lock()) {
+                waited = true;
+                it_cpu->lock.lock();
+            }
+        }
+        if (waited) {
+            cpus[cpu_id].stats.lock_waits++;
+        }
+    }
+
+    void unlock_all() {
+        for (vector<Cpu>::iterator it_cpu = cpus.begin(); it_cpu != cpus.end(); it_cpu++) {
+            it_cpu->lock.unlock();
+        }
+    }
+
+    // Instructions started by all the CPUs, the clock of the pagers. All the locks must be held
+    unsigned long inst_count() {
+        unsigned long total = 0;
+        for (vector<Cpu>::iterator it_cpu = cpus.begin(); it_cpu != cpus.end(); it_cpu++) {
+            total += it_cpu->stats.inst_count;
+        }
+        return total;
+    }
+
+};
+
+template <class PagerType>
+struct Simulator {
+
+    PagerType* pager; // pointer to Pager algorithm
+    Process* curr_process; // pointer to current process
+    InstructionReader* reader; // source of the instructions, pulled one at a time
+    // SMP mode : the simulated CPU run by this simulator, among num_cpus
+    int cpu_id;
+    int num_cpus;
+    unsigned long remote_unmaps; // pages of processes of other CPUs our faults evicted
+    // Readahead found during the current instruction, done once the instruction is complete
+    Process* readahead_process;
+    int readahead_start;
+    int readahead_count; // 0 if none
+    Frame* readahead_trigger; // frame of the page whose access started the readahead
+
+    Simulator(PagerType* pager_, InstructionReader* reader_) {
+        pager = pager_;
+        curr_process = 0;
+        reader = reader_;
+        cpu_id = 0;
+        num_cpus = 1;
+        remote_unmaps = 0;
+        readahead_process = 0;
+        readahead_start = 0;
+        readahead_count = 0;
+        readahead_trigger = 0;
+    }
+
+    Frame* get_frame() {
+        Frame* new_frame = allocate_frame_from_free_list();
+        if (new_frame == 0) {
             new_frame = pager->select_victim_frame();
+            sim->direct_reclaims++;
         }
         return new_frame;
     }
 
-    Instruction get_next_instruction() {
-        Instruction next_instruction = instructions.front();
-        instructions.pop();
-        return next_instruction;
+    // Reclaim daemon (-k), the kswapd of the simulated machine. Woken up when the free frames go below the low
+    // watermark, it evicts the victims of the pager until the high watermark is reached, so the next faults
+    // find a free frame instead of paying UNMAP and OUT themselves. It runs in the background of the simulated
+    // machine : its cost goes to reclaim_cost, not to the cost of the instructions
+    void reclaim() {
+        sim->kswapd_wakeups++;
+        if (sim->OUTPUT_OPS) { sim->output.event("KSWAPD", sim->numFreeFrames); }
+        unsigned long instructions_cost = sim->cost;
+        while (sim->numFreeFrames < sim->RECLAIM_HIGH) {
+            Frame* victim_frame = pager->select_victim_frame();
+            sim->cost += sim->costs.unmap;
+            victim_frame->unmap();
+            release_frame_to_free_list(victim_frame);
+            pager->on_free(victim_frame);
+            sim->pages_reclaimed++;
+        }
+        sim->reclaim_cost += sim->cost - instructions_cost;
+        sim->cost = instructions_cost;
+    }
+
+    // Translation of a read or a write : TLB first if we have one, then the page table walk.
+    // tlb_hit is set if the translation came from the TLB
+    PTE* translate(int vpage, bool& tlb_hit) {
+        tlb_hit = false;
+        if (vpage < 0 || vpage >= MAX_NUM_PTE) {
+            return 0; // outside of the address space, the TLB sets can't hold it
+        }
+        if (sim->tlb != 0) {
+            PTE* pte = sim->tlb->lookup(curr_process->pid, vpage);
+            if (pte != 0) {
+                tlb_hit = true;
+                return pte;
+            }
+        }
+        // Walk the page table. We get no PTE if the page is not in a VMA
+        return curr_process->translate(vpage);
+    }
+
+    // Hardware sets the R bit of an accessed page. The pager is told when the bit goes from 0 to 1,
+    // or of every access if it keeps track of them
+    void set_referenced(PTE* pte) {
+        if (pager->tracks_accesses) {
+            pager->on_access(&sim->frameTable[pte->physAddr]);
+        }
+        if (!pte->referenced) {
+            pte->referenced = 1;
+            Frame* frame = &sim->frameTable[pte->physAddr];
+            if (frame->prefetched) {
+                prefetch_hit(frame);
+            }
+            pager->on_reference(frame);
+        }
+    }
+
+    // Same for the M bit
+    void set_modified(PTE* pte) {
+        if (!pte->modified) {
+            pte->modified = 1;
+            pager->on_modify(&sim->frameTable[pte->physAddr]);
+        }
+    }
+
+    bool get_next_instruction(Instruction& next_instruction) {
+        return reader->next(next_instruction);
     }
 
     void page_fault_handler(Process* curr_process, PTE* pte, int vpage) {
         // Page fault exception
+        pager->on_fault(curr_process, vpage);
         // Get new frame to allocate
         Frame* newFrame = get_frame();
 
         // If new frame was already mapped, we unmap it
         if (! newFrame->isFree) {
-            cost += COST_UNMAP;
+            if (num_cpus > 1 && newFrame->process->pid % num_cpus != cpu_id) {
+                remote_unmaps++;
+            }
+            sim->cost += sim->costs.unmap;
             newFrame->unmap();
         }
         // Now we map the frame
-        cost += COST_MAP;
+        sim->cost += sim->costs.map;
         newFrame->map( curr_process, vpage );
-        curr_process->pstats["maps"]++;
-        frameTable[newFrame->fid] = *newFrame;
+        curr_process->pstats[PSTAT_MAPS]++;
+        pager->on_map(newFrame);
 
         // Update PTE
         pte->physAddr = newFrame->fid;
         pte->valid = 1;
 
+        if (sim->time != 0) {
+            sim->time->faulted = true;
+        }
+        if (sim->READAHEAD_MAX > 0) {
+            detect_sequential_fault(newFrame);
+        }
+
     }
 
-     void simulation() {
+    // Readahead (-r), like the one of the Linux page cache. A fault on the page following the last fault or
+    // the last readahead of its VMA continues a sequential stream : the next pages are prefetched, first
+    // READAHEAD_INITIAL of them, then twice more at each readahead of the stream up to READAHEAD_MAX.
+    // The first access to the marker page, in the middle of a batch, prefetches the next batch before the
+    // stream faults again. Only the pages with something to read (file mapped or paged out) are prefetched
+    static const int READAHEAD_INITIAL = 4;
+
+    // A batch takes at most all the frames but one, the page whose access started it keeps its frame
+    void request_readahead(Frame* trigger, VMA* vma, int start, int count) {
+        count = min(count, sim->MAX_NUM_FRAMES - 1);
+        int end = min(start + count - 1, vma->end_page);
+        vma->ra_next = end + 1;
+        vma->ra_marker = (end >= start) ? start + (end - start) / 2 : -1;
+        readahead_process = trigger->process;
+        readahead_trigger = trigger;
+        readahead_start = start;
+        readahead_count = max(end - start + 1, 0);
+    }
 
+    void detect_sequential_fault(Frame* frame) {
+        int vpage = frame->vpage;
+        VMA* vma = frame->process->find_vma(vpage);
+        if (vpage == vma->ra_next) {
+            vma->ra_window = (vma->ra_window == 0) ? READAHEAD_INITIAL : vma->ra_window * 2;
+            vma->ra_window = min(vma->ra_window, sim->READAHEAD_MAX);
+            request_readahead(frame, vma, vpage + 1, vma->ra_window);
+        } else {
+            vma->ra_next = vpage + 1;
+            vma->ra_window = 0;
+            vma->ra_marker = -1;
+        }
+    }
 
-         while( ! instructions.empty() ) {
-             Instruction curr_instruction = get_next_instruction();
-             inst_count++;
-             curr_instruction.print_instr();
-             if (curr_instruction.iid == 40) {
-                 int caca = 0;
+    // First access to a prefetched page
+    void prefetch_hit(Frame* frame) {
+        frame->prefetched = false;
+        sim->readahead_hits++;
+        if (sim->time != 0) {
+            sim->time->block(frame->ready_time);
+        }
+        VMA* vma = frame->process->find_vma(frame->vpage);
+        if (frame->vpage == vma->ra_marker) {
+            vma->ra_window = min(vma->ra_window * 2, sim->READAHEAD_MAX);
+            request_readahead(frame, vma, vma->ra_next, vma->ra_window);
+        }
+    }
+
+    // Map the pages of the readahead found by the last instruction, as one batch
+    void readahead() {
+        Process* process = readahead_process;
+        int start = readahead_start;
+        int end = readahead_start + readahead_count;
+        readahead_count = 0;
+        if (sim->OUTPUT_OPS) { sim->output.event("READAHEAD", process->pid, start); }
+        bool prefetched = false;
+        for (int vpage = start; vpage < end; vpage++) {
+            int num_tables = process->pageTable.num_tables;
+            PTE* pte = process->get_pte(vpage);
+            if (PT_COSTS) {
+                sim->cost += (unsigned long) (process->pageTable.num_tables - num_tables) * COST_PT_ALLOC;
+            }
+            if (pte->valid || !(pte->file_mapped || pte->pagedout)) {
+                continue;
+            }
+            // Same bookkeeping as a fault for the pagers keeping a history of the pages
+            pager->on_fault(process, vpage);
+            Frame* newFrame = allocate_frame_from_free_list();
+            if (newFrame == 0) {
+                newFrame = pager->select_victim_frame();
+                // The page which started the batch is in use : it keeps its frame and the batch stops there.
+                // Its access set R, the selection may have reset it
+                if (newFrame == readahead_trigger) {
+                    pager->on_keep(newFrame);
+                    newFrame->get_pte()->referenced = 1;
+                    break;
+                }
+                sim->direct_reclaims++;
+            }
+            if (! newFrame->isFree) {
+                sim->cost += sim->costs.unmap;
+                newFrame->unmap();
+            }
+            sim->cost += sim->costs.map;
+            newFrame->map(process, vpage, true);
+            process->pstats[PSTAT_MAPS]++;
+            pager->on_prefetch(newFrame);
+            pte->physAddr = newFrame->fid;
+            pte->valid = 1;
+            sim->readahead_pages++;
+            prefetched = true;
+        }
+        if (prefetched) {
+            sim->readahead_batches++;
+        }
+    }
+
+     void simulation() {
+
+
+         Instruction curr_instruction;
+         while( get_next_instruction(curr_instruction) ) {
+             sim->inst_count++;
+             if (sim->OUTPUT_OPS) { curr_instruction.print_instr(); }
+             if (curr_instruction.iid == 40) {
+                 int caca = 0;
+             }
+             if (sim->time != 0) {
+                 start_timed_instruction(curr_instruction);
+             }
+             execute(curr_instruction);
+             if (readahead_count > 0) {
+                 readahead();
              }
+             if (sim->time != 0) {
+                 end_timed_instruction();
+             }
+             if (sim->numFreeFrames < sim->RECLAIM_LOW) {
+                 reclaim();
+             }
+
+         }// end while
+         if (sim->time != 0) {
+             sort(sim->time->fault_latencies.begin(), sim->time->fault_latencies.end());
+         }
+
+    } // end simulation
+
+    // Time model (-d) : the instruction of a blocked process waits for the read of its page, the CPU stays
+    // idle meanwhile. A context switch doesn't wait, the next process may be ready
+    void start_timed_instruction(const Instruction& instruction) {
+        TimeModel* time = sim->time;
+        time->process = (instruction.command == 'c') ? 0 : curr_process;
+        if (time->process != 0 && time->process->ready_time > time->clock) {
+            time->idle_time += time->process->ready_time - time->clock;
+            time->clock = time->process->ready_time;
+        }
+        time->start = time->clock;
+        time->start_cost = sim->cost;
+        time->io_cost = 0;
+        time->ready = 0;
+        time->faulted = false;
+    }
+
+    // The CPU is done with the instruction. If it still waits for a read, its process is blocked until then
+    void end_timed_instruction() {
+        TimeModel* time = sim->time;
+        unsigned long cpu = sim->cost - time->start_cost - time->io_cost;
+        time->cpu_time += cpu;
+        time->clock += cpu;
+        if (time->faulted) {
+            time->fault_latencies.push_back(max(time->clock, time->ready) - time->start);
+        }
+        if (time->process != 0 && time->ready > time->clock) {
+            time->process->ready_time = time->ready;
+        }
+        // The writebacks of the reclaim daemon are submitted from there
+        time->start_cost = sim->cost;
+        time->io_cost = 0;
+    }
+
+    // Execute one instruction on the current process
+    void execute(const Instruction& curr_instruction) {
+
              switch (curr_instruction.command) {
 
                  // CONTEXT SWITCH
                  case 'c' : {
-                    ctx_switches++;
-                    cost += COST_CTX_SWITCH;
+                    sim->ctx_switches++;
+                    sim->cost += sim->costs.ctx_switch;
                     int pid_to_switch = curr_instruction.arg; // pid of process to switch to
-                    curr_process = &processes[pid_to_switch]; // pointer to process to switch to
+                    if (sim->tlb != 0 && curr_process != &sim->processes[pid_to_switch]) {
+                        sim->tlb->switch_process();
+                    }
+                    curr_process = &sim->processes[pid_to_switch]; // pointer to process to switch to
                     break;
                  }
                  // READ
                  case 'r' : {
-                    cost += COST_READ;
+                    sim->cost += sim->costs.read;
 
                     int vpage = curr_instruction.arg;
-                    PTE* pte = &(curr_process->pageTable[vpage]);
+                    bool tlb_hit;
+                    PTE* pte = translate(vpage, tlb_hit);
 
-                    if (!pte->valid) {
+                    if (pte == 0 || !pte->valid) {
                         // Verify it is in a valid VMA
-                        if (! curr_process->isInVMA(vpage)) {
+                        if (pte == 0) {
                             // SEGV exception
-                            cost += COST_SEGV;
-                            curr_process->pstats["segv"]++;
+                            sim->cost += sim->costs.segv;
+                            curr_process->pstats[PSTAT_SEGV]++;
 
-                            printf(" SEGV\n");
+                            if (sim->OUTPUT_OPS) { sim->output.event("SEGV"); }
 //                            cout << " SEGV" << endl;
                             break;
                         }
                         page_fault_handler(curr_process, pte, vpage);
                     }
+                    if (sim->tlb != 0 && !tlb_hit) {
+                        sim->tlb->insert(curr_process->pid, vpage, pte);
+                    }
 
                     // Simuate hardware read
-                    pte->referenced = 1;
+                    set_referenced(pte);
                     break;
                  }
 
                 case 'w' : {
-                    cost += COST_WRITE;
+                    sim->cost += sim->costs.write;
 
                     int vpage = curr_instruction.arg;
-                    PTE* pte = &(curr_process->pageTable[vpage]);
-                    if (!pte->valid) {
+                    bool tlb_hit;
+                    PTE* pte = translate(vpage, tlb_hit);
+                    if (pte == 0 || !pte->valid) {
                         // Verify it is in a valid VMA
-                        if (! curr_process->isInVMA(vpage)) {
+                        if (pte == 0) {
                             // SEGV exception
-                            cost += COST_SEGV;
-                            curr_process->pstats["segv"]++;
+                            sim->cost += sim->costs.segv;
+                            curr_process->pstats[PSTAT_SEGV]++;
   
-                            printf(" SEGV\n");
+                            if (sim->OUTPUT_OPS) { sim->output.event("SEGV"); }
 //                            cout << " SEGV" << endl;
                             break;
                         }
                         page_fault_handler(curr_process, pte, vpage);
                     }
+                    if (sim->tlb != 0 && !tlb_hit) {
+                        sim->tlb->insert(curr_process->pid, vpage, pte);
+                    }
 
                     // Simuate hardware write
-                    pte->referenced = 1;
-                    // Check if write protected
-                    curr_process->set_write_protection_bit(vpage);
+                    set_referenced(pte);
+                    // Check if write protected (the bit was copied from the VMA when reading the input)
                     if (pte->write_protect == 1) {
                         // SEGPROT Exception
-                        cost += COST_SEGPROT;
-                        printf( " SEGPROT\n");
+                        sim->cost += sim->costs.segprot;
+                        if (sim->OUTPUT_OPS) { sim->output.event("SEGPROT"); }
 //                        cout << " SEGPROT" << endl;
-                        curr_process->pstats["segprot"]++;
+                        curr_process->pstats[PSTAT_SEGPROT]++;
                     } else {
-                        pte->modified = 1;
+                        set_modified(pte);
                     }
                     break;
                  }
 
-                case 'e' : {
-                    process_exits++;
-                    cost += COST_EXIT;
-                    printf("EXIT current process %d\n", curr_process->pid);
-//                    cout << "EXIT current process " << curr_process->pid << endl;
+                case 'e' : {
+                    sim->process_exits++;
+                    sim->cost += sim->costs.exit;
+                    if (sim->OUTPUT_OPS) {
+                        sim->output.put("EXIT current process "); sim->output.put(curr_process->pid); sim->output.put('\n');
+                    }
+//                    cout << "EXIT current process " << curr_process->pid << endl;
+
+                    // Only the allocated leaves of the page table can hold valid or paged out pages
+                    vector<PTE*> leaves;
+                    curr_process->pageTable.get_leaves(leaves);
+                    for (vector<PTE*>::iterator it_leaf = leaves.begin(); it_leaf != leaves.end(); it_leaf++) {
+                        PTE* leaf = *it_leaf;
+                        for ( PTE* it_pte = leaf; it_pte != leaf + PT_LEAF_SIZE; it_pte++ ) {
+                            // If page valid
+                            if (it_pte->valid) {
+                                int frameNumber = it_pte->physAddr;
+                                sim->cost += sim->costs.unmap;
+                                bool onExit = true;
+                                Frame* frame = &(sim->frameTable[frameNumber]);
+                                frame->unmap(onExit);
+                                // Careful. If the frame is a dirty non-fmapped, we must add it to the free pool
+                                // We used the onExit flag to tell the unmap function to NOT put the dirty non-fmapped in the swap area
+                                // The unmap function set the toFreePool flag to tell us that the frame needs to be put in free pool
+                                // We use this complicated flag system because the free frame pool is not available in the unmap scope
+                                // So we have to do the manipulation here
+                                if (frame->toFreePool) {
+                                    release_frame_to_free_list(frame);
+                                    frame->toFreePool = false;
+                                    pager->on_free(frame);
+                                }
+                            }
+                            // If not valid, cancel the page from swap device
+                            else {
+                                it_pte->pagedout = 0;
+                            }
+                        }
+                    }
+
+                    curr_process = 0;
+                } // end case 'e'
+
+             } // end switch
+
+    } // end execute
+
+    // SMP mode : a read or a write of a mapped page which already has its R bit, and its M bit for a write,
+    // changes nothing the pager or the other CPUs can see. Returns false if the instruction must be executed
+    // with all the CPUs stopped, otherwise its cost is added to cost
+    bool fast_access(const Instruction& instr, unsigned long& cost) {
+        if ((instr.command != 'r' && instr.command != 'w') || pager->tracks_accesses || curr_process == 0) {
+            return false;
+        }
+        int vpage = instr.arg;
+        if (vpage < 0 || vpage >= MAX_NUM_PTE) {
+            return false;
+        }
+        PTE* pte = curr_process->pageTable.find(vpage);
+        if (pte == 0 || !pte->in_vma || !pte->valid || !pte->referenced) {
+            return false;
+        }
+        if (instr.command == 'r') {
+            cost += sim->costs.read;
+        } else if (pte->write_protect == 1) {
+            // Only this CPU runs the process, its SEGPROT count is ours
+            cost += sim->costs.write + sim->costs.segprot;
+            curr_process->pstats[PSTAT_SEGPROT]++;
+        } else if (pte->modified) {
+            cost += sim->costs.write;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // SMP mode : run the instructions of the CPU cpu_id, on the thread of this CPU (see simulate_smp)
+    void run_cpu(const vector<Instruction>& stream, SmpCpus& smp) {
+        MmuCpuResults& stats = smp.cpus[cpu_id].stats;
+        unsigned long unlocked_cost = 0; // cost of the instructions done without stopping the other CPUs
+        for (vector<Instruction>::const_iterator it_instr = stream.begin(); it_instr != stream.end(); it_instr++) {
+            const Instruction& curr_instruction = *it_instr;
+            smp.lock_cpu(cpu_id);
+            stats.inst_count++;
+            if (curr_instruction.command == 'c') {
+                stats.ctx_switches++;
+                stats.cost += sim->costs.ctx_switch;
+                unlocked_cost += sim->costs.ctx_switch;
+                curr_process = &sim->processes[curr_instruction.arg];
+                smp.unlock_cpu(cpu_id);
+                continue;
+            }
+            unsigned long access_cost = 0;
+            if (fast_access(curr_instruction, access_cost)) {
+                stats.fast_accesses++;
+                stats.cost += access_cost;
+                unlocked_cost += access_cost;
+                smp.unlock_cpu(cpu_id);
+                continue;
+            }
+            smp.unlock_cpu(cpu_id);
+
+            smp.lock_all(cpu_id);
+            stats.locked_ops++;
+            sim->inst_count = smp.inst_count();
+            unsigned long cost_before = sim->cost;
+            execute(curr_instruction);
+            if (readahead_count > 0) {
+                readahead();
+            }
+            stats.cost += sim->cost - cost_before;
+            if (sim->numFreeFrames < sim->RECLAIM_LOW) {
+                reclaim();
+            }
+            smp.unlock_all();
+        }
+        smp.lock_all(cpu_id);
+        sim->cost += unlocked_cost;
+        stats.remote_unmaps = remote_unmaps;
+        smp.unlock_all();
+    }
+
+    void print_pagetables() {
+
+        for (vector<Process>::iterator it_proc = sim->processes.begin(); it_proc != sim->processes.end(); it_proc++) {
+            sim->output.put("PT["); sim->output.put(it_proc->pid); sim->output.put("]:");
+//            cout << "PT[" << it_proc->pid << "]:";
+            PageTable* pageTable = &(it_proc->pageTable);
+            PTE empty_pte; // pages of leaves never allocated were never used
+            int incr = 0; // index the cirtual page in the page table
+            while ( incr < MAX_NUM_PTE ) {
+                PTE* it_pte = pageTable->find(incr);
+                if (it_pte == 0) {
+                    it_pte = &empty_pte;
+                }
+                // If not valid
+                if ( !it_pte->valid ) {
+                    // We check wrether or not it is paged out
+                    if (it_pte->pagedout) {
+                        sim->output.put(" #");
+//                        cout << " #";
+                   } else {
+                       sim->output.put(" *");
+//                        cout << " *";
+                   }
+                }
+                else {
+                    sim->output.put(' '); sim->output.put(incr); sim->output.put(':');
+//                    cout << " " << incr << ":";
+                    if (it_pte->referenced) {sim->output.put('R');}
+                    else {
+                        sim->output.put('-');
+//                        cout << "-";
+                    }
+
+                    if (it_pte->modified) {
+                        sim->output.put('M');
+//                        cout << "M";
+                    }
+                    else {
+                        sim->output.put('-');
+//                        cout << "-";
+                    }
+
+                    if (it_pte->pagedout) {
+                        sim->output.put('S');
+//                        cout << "S";
+                    }
+                    else {
+                        sim->output.put('-');
+//                       cout << "-";
+                    }
+                }
+                incr++;
+
+            }
+            sim->output.put('\n');
+//            cout << endl; // end of printing one page table
+        }
+
+    }
+
+    void print_frametable() {
+        
+        sim->output.put("FT:");
+//        cout << "FT:";
+        for (vector<Frame>::iterator it_frame = sim->frameTable.begin(); it_frame != sim->frameTable.end(); it_frame++) {
+            if (it_frame->isFree) {
+                sim->output.put(" *");
+//                cout << " *";
+            } else {
+                sim->output.put(' '); sim->output.put(it_frame->process->pid); sim->output.put(':'); sim->output.put(it_frame->vpage);
+//                cout << " " << it_frame->process->pid << ":" << it_frame->vpage;
+            }
+        }
+        sim->output.put('\n');
+//        cout << endl;
+
+    }
+
+    void print_summary() {
+
+        for (vector<Process>::iterator it_proc = sim->processes.begin(); it_proc != sim->processes.end(); it_proc++) {
+            sim->output.put("PROC["); sim->output.put(it_proc->pid);
+            sim->output.put("]: U="); sim->output.put(it_proc->pstats[PSTAT_UNMAPS]);
+            sim->output.put(" M="); sim->output.put(it_proc->pstats[PSTAT_MAPS]);
+            sim->output.put(" I="); sim->output.put(it_proc->pstats[PSTAT_INS]);
+            sim->output.put(" O="); sim->output.put(it_proc->pstats[PSTAT_OUTS]);
+            sim->output.put(" FI="); sim->output.put(it_proc->pstats[PSTAT_FINS]);
+            sim->output.put(" FO="); sim->output.put(it_proc->pstats[PSTAT_FOUTS]);
+            sim->output.put(" Z="); sim->output.put(it_proc->pstats[PSTAT_ZEROS]);
+            sim->output.put(" SV="); sim->output.put(it_proc->pstats[PSTAT_SEGV]);
+            sim->output.put(" SP="); sim->output.put(it_proc->pstats[PSTAT_SEGPROT]);
+            sim->output.put('\n');
+        }
+
+    }
+
+    void print_cpu_summary() {
+
+        for (size_t cpu = 0; cpu < sim->cpus.size(); cpu++) {
+            MmuCpuResults& stats = sim->cpus[cpu];
+            sim->output.put("CPU["); sim->output.put((int) cpu);
+            sim->output.put("]: I="); sim->output.put(stats.inst_count);
+            sim->output.put(" C="); sim->output.put(stats.ctx_switches);
+            sim->output.put(" COST="); sim->output.put(stats.cost);
+            sim->output.put(" FAST="); sim->output.put(stats.fast_accesses);
+            sim->output.put(" LOCKED="); sim->output.put(stats.locked_ops);
+            sim->output.put(" WAITS="); sim->output.put(stats.lock_waits);
+            sim->output.put(" REMOTE="); sim->output.put(stats.remote_unmaps);
+            sim->output.put('\n');
+        }
+
+    }
+
+    void print_reclaim_summary() {
+
+        sim->output.put("KSWAPD: W="); sim->output.put(sim->kswapd_wakeups);
+        sim->output.put(" R="); sim->output.put(sim->pages_reclaimed);
+        sim->output.put(" D="); sim->output.put(sim->direct_reclaims);
+        sim->output.put(" COST="); sim->output.put(sim->reclaim_cost);
+        sim->output.put('\n');
+
+    }
+
+    void print_readahead_summary() {
+
+        sim->output.put("READAHEAD: B="); sim->output.put(sim->readahead_batches);
+        sim->output.put(" P="); sim->output.put(sim->readahead_pages);
+        sim->output.put(" H="); sim->output.put(sim->readahead_hits);
+        sim->output.put(" W="); sim->output.put(sim->readahead_wasted);
+        sim->output.put('\n');
+
+    }
+
+    void print_time_summary() {
+
+        TimeModel* time = sim->time;
+        unsigned long total_time = time->total_time();
+        sim->output.put("TIME: T="); sim->output.put(total_time);
+        sim->output.put(" CPU="); sim->output.put(time->cpu_time);
+        sim->output.put(" IDLE="); sim->output.put(time->idle_time);
+        sim->output.put('\n');
+        sim->output.put("FAULTLAT: N="); sim->output.put((unsigned long) time->fault_latencies.size());
+        sim->output.put(" P50="); sim->output.put(time->latency_percentile(50));
+        sim->output.put(" P90="); sim->output.put(time->latency_percentile(90));
+        sim->output.put(" P99="); sim->output.put(time->latency_percentile(99));
+        sim->output.put(" MAX="); sim->output.put(time->latency_percentile(100));
+        sim->output.put('\n');
+        print_device_summary("swap", time->swap, total_time);
+        print_device_summary("file", time->file, total_time);
+
+    }
+
+    void print_device_summary(const char* name, const IoDevice& device, unsigned long total_time) {
+
+        unsigned long requests = device.reads + device.writes;
+        char util[32];
+        snprintf(util, sizeof(util), "%.1f%%", (total_time == 0) ? 0.0 : 100.0 * device.busy_time / total_time);
+        sim->output.put("IO["); sim->output.put(name);
+        sim->output.put("]: R="); sim->output.put(device.reads);
+        sim->output.put(" W="); sim->output.put(device.writes);
+        sim->output.put(" UTIL="); sim->output.put(util);
+        sim->output.put(" WAIT="); sim->output.put((requests == 0) ? 0UL : device.wait_time / requests);
+        sim->output.put('\n');
+
+    }
+
+    void print_tlb_summary() {
+
+        sim->output.put("TLB: H="); sim->output.put(sim->tlb_hits);
+        sim->output.put(" M="); sim->output.put(sim->tlb_misses);
+        sim->output.put(" F="); sim->output.put(sim->tlb_flushes);
+        sim->output.put(" I="); sim->output.put(sim->tlb_invalidations);
+        sim->output.put('\n');
+
+    }
+
+    void print_pagetable_cost() {
+
+        // tables allocated, all processes and levels
+        unsigned long num_tables = 0;
+        for (vector<Process>::iterator it_proc = sim->processes.begin(); it_proc != sim->processes.end(); it_proc++) {
+            num_tables += it_proc->pageTable.num_tables;
+        }
+
+        sim->output.put("PTCOST "); sim->output.put(PT_LEVELS);
+        sim->output.put(' '); sim->output.put(num_tables);
+        sim->output.put(' '); sim->output.put(sim->pt_walks);
+        sim->output.put(' '); sim->output.put(sim->pt_walk_reads);
+        sim->output.put('\n');
+
+    }
+
+    void print_cost() {
+
+        sim->output.put("TOTALCOST "); sim->output.put(sim->inst_count);
+        sim->output.put(' '); sim->output.put(sim->ctx_switches);
+        sim->output.put(' '); sim->output.put(sim->process_exits);
+        sim->output.put(' '); sim->output.put(sim->cost);
+        sim->output.put(' '); sim->output.put((unsigned long) sizeof(PTE));
+        sim->output.put('\n');
+        
+    }
+
+};
+
+// Put the simulation of the current thread back to its initial state, with all its frames free.
+// The configuration stays (frames, address spaces, page table geometry, TLB geometry, costs)
+void reset_simulation_state() {
+    sim->processes.clear();
+    sim->frameTable.clear();
+    sim->frameFreePoolHead = -1;
+    sim->frameFreePoolTail = -1;
+    sim->numFreeFrames = 0;
+    sim->kswapd_wakeups = 0;
+    sim->pages_reclaimed = 0;
+    sim->direct_reclaims = 0;
+    sim->reclaim_cost = 0;
+    sim->readahead_batches = 0;
+    sim->readahead_pages = 0;
+    sim->readahead_hits = 0;
+    sim->readahead_wasted = 0;
+    sim->inst_count = 0;
+    sim->ctx_switches = 0;
+    sim->process_exits = 0;
+    sim->cost = 0;
+    sim->pt_walks = 0;
+    sim->pt_walk_reads = 0;
+    sim->tlb_hits = 0;
+    sim->tlb_misses = 0;
+    sim->tlb_flushes = 0;
+    sim->tlb_invalidations = 0;
+    sim->cpus.clear();
+    if (sim->tlb != 0) {
+        TLB* used_tlb = sim->tlb;
+        sim->tlb = new TLB(used_tlb->num_entries, used_tlb->num_ways, used_tlb->lru, used_tlb->use_asid);
+        delete used_tlb;
+    }
+    if (sim->time != 0) {
+        sim->time->reset();
+    }
+    initFrameTable(sim->MAX_NUM_FRAMES);
+    initFrameFreePool(sim->MAX_NUM_FRAMES);
+}
+
+template <class PagerType>
+void run_smp_cpu(PagerType* pager, int cpu_id, const vector<Instruction>* stream, SmpCpus* smp, Simulation* simulation) {
+    sim = simulation;
+    Simulator<PagerType> simulator = Simulator<PagerType>(pager, 0);
+    simulator.cpu_id = cpu_id;
+    simulator.num_cpus = (int) smp->cpus.size();
+    simulator.run_cpu(*stream, *smp);
+}
+
+// SMP mode : sim->NUM_CPUS simulated CPUs share the frames, the free pool and the pager, each one on a thread.
+// A process always runs on the CPU pid % NUM_CPUS : the trace is split once between the CPUs, every CPU taking
+// the instructions run while one of its processes is the current one. The order of the instructions of
+// different CPUs depends on the threads, so the results can change from one run to the next
+template <class PagerType>
+void simulate_smp(PagerType* pager, InstructionReader* reader) {
+    int num_cpus = sim->NUM_CPUS;
+    vector<vector<Instruction> > streams (num_cpus);
+    int cpu_id = 0;
+    Instruction instr;
+    while (reader->next(instr)) {
+        if (instr.command == 'c') {
+            cpu_id = instr.arg % num_cpus;
+        }
+        streams[cpu_id].push_back(instr);
+    }
+
+    SmpCpus smp (num_cpus);
+    vector<thread> threads;
+    for (int cpu = 0; cpu < num_cpus; cpu++) {
+        threads.push_back(thread(run_smp_cpu<PagerType>, pager, cpu, &streams[cpu], &smp, sim));
+    }
+    for (vector<thread>::iterator it_thread = threads.begin(); it_thread != threads.end(); it_thread++) {
+        it_thread->join();
+    }
+
+    sim->inst_count = 0;
+    sim->ctx_switches = 0;
+    for (int cpu = 0; cpu < num_cpus; cpu++) {
+        sim->cpus.push_back(smp.cpus[cpu].stats);
+        sim->inst_count += smp.cpus[cpu].stats.inst_count;
+        sim->ctx_switches += smp.cpus[cpu].stats.ctx_switches;
+    }
+}
+
+// Simulate the whole trace with the simulator specialized for the type of pager if it's this one
+template <class PagerType>
+bool simulate_as(Pager* pager, InstructionReader* reader) {
+    PagerType* typed_pager = dynamic_cast<PagerType*>(pager);
+    if (typed_pager == 0) {
+        return false;
+    }
+    if (sim->NUM_CPUS > 1) {
+        simulate_smp<PagerType>(typed_pager, reader);
+        return true;
+    }
+    Simulator<PagerType> simulator = Simulator<PagerType>(typed_pager, reader);
+    simulator.simulation();
+    return true;
+}
+
+// The type of the pager is found once here. The pagers missing from the list (the benchmark wrappers)
+// are simulated through virtual calls
+void simulate(Pager* pager, InstructionReader* reader) {
+    if (simulate_as<FIFO>(pager, reader) || simulate_as<CLOCK>(pager, reader)
+            || simulate_as<EnhancedSecondChance>(pager, reader) || simulate_as<AGING_SCAN>(pager, reader)
+            || simulate_as<AGING>(pager, reader) || simulate_as<WORKING_SET>(pager, reader)
+            || simulate_as<RANDOM>(pager, reader) || simulate_as<LRU>(pager, reader)
+            || simulate_as<LRU_APPROX>(pager, reader) || simulate_as<LFU>(pager, reader)
+            || simulate_as<ARC>(pager, reader) || simulate_as<CAR>(pager, reader)
+            || simulate_as<TWO_Q>(pager, reader) || simulate_as<OPT>(pager, reader)
+            || simulate_as<Pager>(pager, reader)) {
+        return;
+    }
+}
+
+// -oR : simulate the trace again with OPT and print its cost and the ratio of the cost of the simulation to it,
+// as "OPTCOST <opt cost> <ratio>". Returns -1 and sets error if the trace can't be read again
+int print_opt_ratio(const TraceSource& trace, string& error) {
+    // OPT runs in its own simulation, with the same frames and TLB and without trace
+    Simulation* policy_simulation = sim;
+    Simulation opt_simulation (sim->MAX_NUM_FRAMES, 0);
+    opt_simulation.costs = sim->costs;
+    if (sim->tlb != 0) {
+        opt_simulation.tlb = new TLB(sim->tlb->num_entries, sim->tlb->num_ways, sim->tlb->lru, sim->tlb->use_asid);
+    }
+    sim = &opt_simulation;
+    reset_simulation_state();
+    ifstream input_file;
+    InstructionReader* reader = reopen_trace(trace, input_file, error);
+    Pager* pager = 0;
+    if (reader != 0) {
+        reader->read_processes();
+        pager = create_opt(trace, error);
+    }
+    if (pager != 0) {
+        simulate(pager, reader);
+    }
+    unsigned long opt_cost = sim->cost;
+    sim = policy_simulation;
+    delete pager;
+    delete reader;
+    if (pager == 0) {
+        return -1;
+    }
+
+    char ratio[32];
+    snprintf(ratio, sizeof(ratio), "%.3f", (opt_cost == 0) ? 1.0 : (double) sim->cost / opt_cost);
+    sim->output.put("OPTCOST "); sim->output.put(opt_cost);
+    sim->output.put(' '); sim->output.put(ratio);
+    sim->output.put('\n');
+    return 0;
+}
+
+// Simulate the trace of reader with pager in the simulation of the current thread and print what the output
+// options ask for. Returns -1 and sets error if the OPT simulation of -oR can't be done
+int run_simulation(Pager* pager, InstructionReader* reader, const TraceSource& trace, string& error) {
+    simulate(pager, reader);
+
+    // The tables only depend on the state of the simulation, the generic simulator prints them
+    Simulator<Pager> simulator = Simulator<Pager>(pager, reader);
+
+    if (sim->OUTPUT_PAGETABLES) {
+        simulator.print_pagetables();
+    }
+    if (sim->OUTPUT_FRAMETABLE) {
+        simulator.print_frametable();
+    }
+    if (sim->OUTPUT_SUMMARY) {
+        simulator.print_summary();
+        simulator.print_cpu_summary();
+        if (sim->RECLAIM_LOW > 0) {
+            simulator.print_reclaim_summary();
+        }
+        if (sim->READAHEAD_MAX > 0) {
+            simulator.print_readahead_summary();
+        }
+        if (sim->time != 0) {
+            simulator.print_time_summary();
+        }
+        if (sim->tlb != 0) {
+            simulator.print_tlb_summary();
+        }
+        if (PT_COSTS) {
+            simulator.print_pagetable_cost();
+        }
+        simulator.print_cost();
+    }
+    if (sim->OUTPUT_OPT_RATIO) {
+        if (print_opt_ratio(trace, error) != 0) {
+            sim->output.flush();
+            return -1;
+        }
+    }
+    sim->output.flush();
+    return 0;
+}
+
+//-------------------- STEP 10 : Simulation engine --------------------
+// The API of mmu.h. A run creates its Simulation, makes it the one of the current thread while it runs and
+// gives the previous one back at the end, so runs can even be started from inside another one
+
+// Simulate the trace of reader with the config. OPT and -oR read the trace again
+MmuResults run_engine(const MmuConfig& config, InstructionReader* reader, const TraceSource& trace) {
+    MmuResults results;
+    if (config.num_frames < 1 || config.num_frames > MAX_FRAMES_LIMIT) {
+        results.error = "The number of frames must be between 1 and " + to_string(MAX_FRAMES_LIMIT) + ".";
+        return results;
+    }
+    if (config.working_set_tau < 0) {
+        results.error = "The working set TAU must be >= 0.";
+        return results;
+    }
+    if (config.pipeline_stages < 1 || config.pipeline_stages > 3) {
+        results.error = "The pipeline must have 1 to 3 stages.";
+        return results;
+    }
+    if (config.reclaim_low < 0 || config.reclaim_high < config.reclaim_low || config.reclaim_high > config.num_frames
+            || (config.reclaim_low == 0 && config.reclaim_high > 0)) {
+        results.error = "The reclaim watermarks must be 0 < low <= high <= frames.";
+        return results;
+    }
+    if (config.readahead_max < 0) {
+        results.error = "The readahead window must be >= 0.";
+        return results;
+    }
+    // OPT knows the next use of the page of each instruction, not of the prefetched pages
+    if (config.readahead_max > 0 && config.algorithm == "opt") {
+        results.error = "The readahead can't be used with -aopt.";
+        return results;
+    }
+    if (config.io_depth < 0 || config.io_transfer < 0) {
+        results.error = "The queue depth and the transfer time of the devices must be >= 0.";
+        return results;
+    }
+    if (config.num_cpus < 1) {
+        results.error = "The number of CPUs must be >= 1.";
+        return results;
+    }
+    // One clock for the whole machine
+    if (config.num_cpus > 1 && config.io_depth > 0) {
+        results.error = "The time model can't be used in the SMP mode.";
+        return results;
+    }
+    // The CPUs of the SMP mode run in any order : no trace, no OPT and no TLB (it would need shootdowns)
+    if (config.num_cpus > 1 && (config.output_options.find_first_of("OR") != string::npos || config.tlb_entries > 0
+            || PT_COSTS || config.algorithm == "opt")) {
+        results.error = "The SMP mode can't be used with the O and R output options, -T, -l or -aopt.";
+        return results;
+    }
+    int tlb_ways = (config.tlb_ways == 0) ? config.tlb_entries : config.tlb_ways;
+    if (config.tlb_entries < 0 || (config.tlb_entries > 0 && (tlb_ways < 1 || config.tlb_entries % tlb_ways != 0))) {
+        results.error = "The TLB entries must be a multiple of its ways.";
+        return results;
+    }
+    if (config.algorithm.size() == 1 && tolower(config.algorithm[0]) == 'r' && config.random_numbers.empty()) {
+        results.error = "The algorithm r needs the random numbers.";
+        return results;
+    }
+
+    Simulation simulation (config.num_frames, config.output);
+    const string& options = config.output_options;
+    simulation.OUTPUT_OPS = (options.find('O') != string::npos);
+    simulation.OUTPUT_PAGETABLES = (options.find('P') != string::npos);
+    simulation.OUTPUT_FRAMETABLE = (options.find('F') != string::npos);
+    simulation.OUTPUT_SUMMARY = (options.find('S') != string::npos);
+    simulation.OUTPUT_OPT_RATIO = (options.find('R') != string::npos);
+    simulation.costs = config.costs;
+    simulation.WORKING_SET_TAU = config.working_set_tau;
+    simulation.NUM_CPUS = config.num_cpus;
+    simulation.RECLAIM_LOW = config.reclaim_low;
+    simulation.RECLAIM_HIGH = config.reclaim_high;
+    simulation.READAHEAD_MAX = config.readahead_max;
+    if (config.tlb_entries > 0) {
+        simulation.tlb = new TLB(config.tlb_entries, tlb_ways, config.tlb_lru, config.tlb_asid);
+    }
+    if (config.io_depth > 0) {
+        simulation.time = new TimeModel(config.io_depth, config.io_transfer);
+    }
+
+    // Pipelined mode : the simulation reads the instructions parsed by another thread, and may hand its
+    // output to a third one. Its ring of batches is big, we only build it when it's used. It's deleted before
+    // the end of the run so the parser stops before the simulation goes away
+    PipelinedInstructionReader* pipelined_reader = 0;
+    if (config.pipeline_stages >= 2) {
+        pipelined_reader = new PipelinedInstructionReader(reader);
+        reader = pipelined_reader;
+    }
+    if (config.pipeline_stages == 3) {
+        simulation.output.start_writer();
+    }
+
+    Simulation* caller_simulation = sim;
+    sim = &simulation;
+    reset_simulation_state();
+    reader->read_processes();
+    istringstream rand_file (config.random_numbers);
+    string error;
+    Pager* pager = create_pager(config.algorithm.c_str(), rand_file, trace, error);
+    if (pager == 0) {
+        results.error = error;
+    } else if (run_simulation(pager, reader, trace, error) != 0) {
+        results.error = "Could not simulate OPT for the R output option. " + error;
+    } else {
+        results.ok = true;
+        results.inst_count = simulation.inst_count;
+        results.ctx_switches = simulation.ctx_switches;
+        results.process_exits = simulation.process_exits;
+        results.cost = simulation.cost;
+        results.tlb_hits = simulation.tlb_hits;
+        results.tlb_misses = simulation.tlb_misses;
+        results.tlb_flushes = simulation.tlb_flushes;
+        results.tlb_invalidations = simulation.tlb_invalidations;
+        results.pt_walks = simulation.pt_walks;
+        results.pt_walk_reads = simulation.pt_walk_reads;
+        for (vector<Process>::iterator it_proc = simulation.processes.begin(); it_proc != simulation.processes.end(); it_proc++) {
+            MmuProcessResults process;
+            process.unmaps = it_proc->pstats[PSTAT_UNMAPS];
+            process.maps = it_proc->pstats[PSTAT_MAPS];
+            process.ins = it_proc->pstats[PSTAT_INS];
+            process.outs = it_proc->pstats[PSTAT_OUTS];
+            process.fins = it_proc->pstats[PSTAT_FINS];
+            process.fouts = it_proc->pstats[PSTAT_FOUTS];
+            process.zeros = it_proc->pstats[PSTAT_ZEROS];
+            process.segv = it_proc->pstats[PSTAT_SEGV];
+            process.segprot = it_proc->pstats[PSTAT_SEGPROT];
+            results.processes.push_back(process);
+            results.pt_tables += it_proc->pageTable.num_tables;
+        }
+        results.cpus = simulation.cpus;
+        results.kswapd_wakeups = simulation.kswapd_wakeups;
+        results.pages_reclaimed = simulation.pages_reclaimed;
+        results.direct_reclaims = simulation.direct_reclaims;
+        results.reclaim_cost = simulation.reclaim_cost;
+        results.readahead_batches = simulation.readahead_batches;
+        results.readahead_pages = simulation.readahead_pages;
+        results.readahead_hits = simulation.readahead_hits;
+        results.readahead_wasted = simulation.readahead_wasted;
+        if (simulation.time != 0) {
+            TimeModel* time = simulation.time;
+            results.total_time = time->total_time();
+            results.cpu_time = time->cpu_time;
+            results.idle_time = time->idle_time;
+            results.faults = time->fault_latencies.size();
+            results.fault_latency_p50 = time->latency_percentile(50);
+            results.fault_latency_p90 = time->latency_percentile(90);
+            results.fault_latency_p99 = time->latency_percentile(99);
+            results.fault_latency_max = time->latency_percentile(100);
+            IoDevice* devices[2] = { &time->swap, &time->file };
+            MmuDeviceResults* device_results[2] = { &results.swap, &results.file };
+            for (int i = 0; i < 2; i++) {
+                device_results[i]->reads = devices[i]->reads;
+                device_results[i]->writes = devices[i]->writes;
+                device_results[i]->busy_time = devices[i]->busy_time;
+                device_results[i]->wait_time = devices[i]->wait_time;
+            }
+        }
+    }
+    delete pager;
+    delete pipelined_reader;
+    sim = caller_simulation;
+    return results;
+}
+
+} // end of the private part
+
+MmuTrace::~MmuTrace() {
+    free(data);
+}
+
+bool MmuTrace::load(const char* path_, string& error) {
+    free(data);
+    data = 0;
+    size = 0;
+    path = path_;
+    ifstream input_file ( path_ );
+    if ( !input_file.is_open() ) {
+        error = "Could not open the input file " + path;
+        return false;
+    }
+    // The conversion reads the processes in a simulation of its own
+    Simulation conversion (0, 0);
+    Simulation* caller_simulation = sim;
+    sim = &conversion;
+    long num_instructions = -1;
+    InstructionReader* reader = open_instruction_reader(path_, input_file);
+    if (reader != 0) {
+        FILE* trace_file = open_memstream(&data, &size);
+        num_instructions = convert_to_binary(reader, trace_file);
+        fclose(trace_file);
+        delete reader;
+    }
+    sim = caller_simulation;
+    if (num_instructions < 0) {
+        free(data);
+        data = 0;
+        size = 0;
+        error = "Could not read the input file " + path;
+        return false;
+    }
+    return true;
+}
+
+MmuResults MmuEngine::run(const char* input_path) {
+    ifstream input_file ( input_path );
+    if ( !input_file.is_open() ) {
+        MmuResults results;
+        results.error = "Could not open the input file " + string(input_path);
+        return results;
+    }
+    InstructionReader* reader = open_instruction_reader(input_path, input_file);
+    if (reader == 0) {
+        MmuResults results;
+        results.error = "Could not read the input file " + string(input_path);
+        return results;
+    }
+    MmuResults results = run_engine(config, reader, TraceSource(input_path));
+    delete reader;
+    return results;
+}
+
+MmuResults MmuEngine::run(const MmuTrace& trace) {
+    BinaryInstructionReader reader;
+    reader.open_buffer(trace.data, trace.size);
+    if (trace.data == 0 || !reader.check_header()) {
+        MmuResults results;
+        results.error = "The trace " + trace.path + " is not loaded";
+        return results;
+    }
+    return run_engine(config, &reader, TraceSource(trace.path.c_str(), trace.data, trace.size));
+}
+
+bool mmu_set_address_space(int num_vpages, int levels, int walk_cost, int alloc_cost) {
+    if (num_vpages < 1 || num_vpages > MAX_PTE_LIMIT || levels < 0 || levels > PT_MAX_LEVELS
+            || walk_cost < 0 || alloc_cost < 0) {
+        return false;
+    }
+    // A flat table of a big address space would take gigabytes in every process
+    if (levels > 0 && levels < pagetable_min_levels(num_vpages)) {
+        return false;
+    }
+    MAX_NUM_PTE = num_vpages;
+    PT_COSTS = (levels > 0);
+    if (PT_COSTS) {
+        COST_PT_WALK = walk_cost;
+        COST_PT_ALLOC = alloc_cost;
+        init_pagetable_geometry(levels);
+    } else {
+        init_pagetable_geometry(0);
+    }
+    return true;
+}
+
+// The rest is the mmu command line, left out of the library
+#ifndef MMU_LIBRARY
+namespace {
+
+//-------------------- STEP 11 : Benchmarks --------------------
+// Small benchmarks selected with -b<name>. They take the input file as only non-option argument
+// and print their results on the standard output
+
+double elapsed_seconds(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Count the lines of a file, used to report lines/sec
+unsigned long count_lines(const char* path) {
+    ifstream file(path);
+    unsigned long num_lines = 0;
+    string line;
+    while (getline(file, line)) {
+        num_lines++;
+    }
+    return num_lines;
+}
+
+// Parse the whole file with the given reader. Returns a checksum of the instructions to make sure
+// both readers see the same trace (and that the compiler doesn't optimize the parsing away)
+unsigned long parse_whole_trace(InstructionReader* reader) {
+    sim->processes.clear();
+    reader->read_processes();
+    unsigned long checksum = sim->processes.size();
+    Instruction instr;
+    while (reader->next(instr)) {
+        checksum = checksum * 31 + instr.command * 131 + instr.arg;
+    }
+    return checksum;
+}
+
+// -bparse : throughput of the getline/stringstream reader against the mmap reader
+int benchmark_parse(const char* path) {
+    unsigned long num_lines = count_lines(path);
+    const int num_rounds = 5;
+    double best_stream = 1e30, best_mapped = 1e30;
+    unsigned long checksum_stream = 0, checksum_mapped = 0;
+
+    for (int round = 0; round < num_rounds; round++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        ifstream input_file(path);
+        StreamInstructionReader stream_reader = StreamInstructionReader(input_file);
+        checksum_stream = parse_whole_trace(&stream_reader);
+        best_stream = min(best_stream, elapsed_seconds(start));
+
+        start = chrono::steady_clock::now();
+        MappedInstructionReader mapped_reader;
+        if (!mapped_reader.open(path)) {
+            fprintf(stderr, "Could not mmap %s\n", path);
+            return -1;
+        }
+        checksum_mapped = parse_whole_trace(&mapped_reader);
+        best_mapped = min(best_mapped, elapsed_seconds(start));
+    }
+
+    printf("parse benchmark on %s : %lu lines, best of %d rounds\n", path, num_lines, num_rounds);
+    printf("stream (getline+stringstream) : %10.4f s %14.0f lines/sec\n", best_stream, num_lines / best_stream);
+    printf("mmap (zero-copy tokenizer)    : %10.4f s %14.0f lines/sec\n", best_mapped, num_lines / best_mapped);
+    printf("speedup x%.2f, checksums %s\n", best_stream / best_mapped,
+            checksum_stream == checksum_mapped ? "match" : "DIFFER");
+    return checksum_stream == checksum_mapped ? 0 : 1;
+}
+
+// -bpstats : cost of the statistics updates of a page fault, with the old string keyed map and the counter array.
+// A fault does one MAP and one of ZERO/IN/FIN, and when memory is full one UNMAP and maybe one OUT/FOUT
+int benchmark_pstats() {
+    const unsigned long num_faults = 20000000;
+    const int num_procs = 8;
+    vector< map<string, unsigned long> > map_stats(num_procs);
+    vector<Process> array_processes;
+    for (int i = 0; i < num_procs; i++) {
+        array_processes.push_back(Process(i, 0));
+    }
+    const char* in_names[3] = {"zeros", "ins", "fins"};
+    const PStat in_stats[3] = {PSTAT_ZEROS, PSTAT_INS, PSTAT_FINS};
+    const char* out_names[2] = {"outs", "fouts"};
+    const PStat out_stats[2] = {PSTAT_OUTS, PSTAT_FOUTS};
+
+    // Same pseudo random fault sequence for both
+    unsigned int seed = 12345;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (unsigned long i = 0; i < num_faults; i++) {
+        seed = seed * 1103515245 + 12345;
+        map<string, unsigned long>& victim = map_stats[(seed >> 8) % num_procs];
+        map<string, unsigned long>& faulter = map_stats[(seed >> 12) % num_procs];
+        victim["unmaps"]++;
+        if (seed & 0x10000) {
+            victim[out_names[(seed >> 17) & 1]]++;
+        }
+        faulter[in_names[(seed >> 20) % 3]]++;
+        faulter["maps"]++;
+    }
+    double map_time = elapsed_seconds(start);
+
+    seed = 12345;
+    start = chrono::steady_clock::now();
+    for (unsigned long i = 0; i < num_faults; i++) {
+        seed = seed * 1103515245 + 12345;
+        Process& victim = array_processes[(seed >> 8) % num_procs];
+        Process& faulter = array_processes[(seed >> 12) % num_procs];
+        victim.pstats[PSTAT_UNMAPS]++;
+        if (seed & 0x10000) {
+            victim.pstats[out_stats[(seed >> 17) & 1]]++;
+        }
+        faulter.pstats[in_stats[(seed >> 20) % 3]]++;
+        faulter.pstats[PSTAT_MAPS]++;
+    }
+    double array_time = elapsed_seconds(start);
+
+    // Check both versions counted the same thing
+    bool same = true;
+    const char* names[NUM_PSTATS] = {"unmaps", "maps", "ins", "outs", "fins", "fouts", "zeros", "segv", "segprot"};
+    for (int p = 0; p < num_procs; p++) {
+        for (int k = 0; k < NUM_PSTATS; k++) {
+            same = same && (map_stats[p][names[k]] == array_processes[p].pstats[k]);
+        }
+    }
+
+    printf("pstats benchmark : %lu faults over %d processes\n", num_faults, num_procs);
+    printf("map<string, unsigned long> : %8.2f ns/fault\n", map_time * 1e9 / num_faults);
+    printf("counter array              : %8.2f ns/fault\n", array_time * 1e9 / num_faults);
+    printf("speedup x%.2f, counters %s\n", map_time / array_time, same ? "match" : "DIFFER");
+    return same ? 0 : 1;
+}
+
+// Synthetic trace for the pager benchmarks : one process with a single VMA of num_pages pages.
+// The first warmup accesses touch the pages in order (to fill the frame table), then 70% of the
+// accesses go to a hot set of hot_pages pages and 30% anywhere, with a write every 4 accesses
+struct SyntheticInstructionReader: public InstructionReader {
+
+    int num_pages;
+    int hot_pages;
+    int warmup;
+    long num_instructions;
+    unsigned int seed;
+
+    SyntheticInstructionReader(int num_pages_, int hot_pages_, int warmup_, long num_instructions_) {
+        num_pages = num_pages_;
+        hot_pages = hot_pages_;
+        warmup = warmup_;
+        num_instructions = num_instructions_;
+        seed = 42;
+    }
+
+    unsigned int next_random() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    void read_processes() {
+        sim->NUM_PROCESSES = 1;
+        Process process = Process(0, 1);
+        process.add_vma(VMA(0, 0, num_pages - 1, false, false));
+        sim->processes.push_back(process);
+    }
+
+    bool next(Instruction& instr) {
+        if (count >= num_instructions) {
+            return false;
+        }
+        if (count == 0) {
+            instr = Instruction(count++, 'c', 0);
+            return true;
+        }
+        if (count <= warmup) {
+            instr = Instruction(count, 'r', count - 1);
+            count++;
+            return true;
+        }
+        unsigned int r = next_random();
+        int vpage = (r % 10 < 7) ? (int) ((r >> 8) % hot_pages) : (int) ((r >> 8) % num_pages);
+        instr = Instruction(count++, (r & 0x30) ? 'r' : 'w', vpage);
+        return true;
+    }
+
+};
+
+// Pager wrapper used by the benchmarks : times the victim selections and hashes the victims
+// so two implementations of the same algorithm can be checked against each other
+class RecordingPager final : public Pager {
+
+    public:
+        Pager* pager;
+        unsigned long num_selections;
+        unsigned long victims_hash;
+        double selection_time;
+
+        RecordingPager(Pager* pager_) {
+            pager = pager_;
+            tracks_accesses = pager->tracks_accesses;
+            num_selections = 0;
+            victims_hash = 0;
+            selection_time = 0;
+        }
+
+        ~RecordingPager() {
+            delete pager;
+        }
+
+        void on_fault(Process* process, int vpage) {
+            pager->on_fault(process, vpage);
+        }
+
+        void on_map(Frame* frame) {
+            pager->on_map(frame);
+        }
+
+        void on_prefetch(Frame* frame) {
+            pager->on_prefetch(frame);
+        }
+
+        void on_keep(Frame* frame) {
+            pager->on_keep(frame);
+        }
+
+        void on_reference(Frame* frame) {
+            pager->on_reference(frame);
+        }
+
+        void on_modify(Frame* frame) {
+            pager->on_modify(frame);
+        }
+
+        void on_access(Frame* frame) {
+            pager->on_access(frame);
+        }
+
+        void on_free(Frame* frame) {
+            pager->on_free(frame);
+        }
+
+        Frame* select_victim_frame() {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            Frame* victim = pager->select_victim_frame();
+            selection_time += elapsed_seconds(start);
+            num_selections++;
+            victims_hash = victims_hash * 1000003 + victim->fid;
+            return victim;
+        }
+
+};
+
+// Put the simulation of the current thread back to its initial state for a new run with num_frames frames
+void reset_simulation(int num_frames, int num_vpages) {
+    sim->processes.clear(); // their page tables are freed with the geometry they were built with
+    sim->MAX_NUM_FRAMES = num_frames;
+    MAX_NUM_PTE = num_vpages;
+    init_pagetable_geometry(0);
+    reset_simulation_state();
+}
+
+// Run the synthetic trace with num_frames frames and the pager built by make_pager :
+// the frame table is filled, then num_instructions random accesses are done
+RecordingPager* run_synthetic(int num_frames, long num_instructions, Pager* (*make_pager)()) {
+    int num_pages = 4 * num_frames;
+    reset_simulation(num_frames, num_pages);
+    SyntheticInstructionReader reader = SyntheticInstructionReader(num_pages, num_frames / 2 + 1, num_frames,
+            num_frames + 1 + num_instructions);
+    reader.read_processes();
+    RecordingPager* pager = new RecordingPager(make_pager());
+    Simulator<Pager> simulator = Simulator<Pager>(pager, &reader);
+    simulator.simulation();
+    return pager;
+}
+
+Pager* make_aging_scan() {
+    return new AGING_SCAN();
+}
+
+Pager* make_aging() {
+    return new AGING();
+}
+
+// -baging : time per victim selection of the full scan AGING against the indexed AGING,
+// for growing frame tables, and check that they pick the same victims
+int benchmark_aging() {
+    const long num_instructions = 20000; // after the frame table is full
+    bool all_same = true;
+    printf("aging benchmark : %ld accesses after filling the frame table, 4 pages per frame\n", num_instructions);
+    printf("%10s %10s %16s %16s %10s %10s\n", "frames", "faults", "scan us/fault", "indexed us/fault", "speedup", "victims");
+    for (int num_frames = 64; num_frames <= 65536; num_frames *= 4) {
+        RecordingPager* scan = run_synthetic(num_frames, num_instructions, make_aging_scan);
+        unsigned long scan_cost = sim->cost;
+        RecordingPager* indexed = run_synthetic(num_frames, num_instructions, make_aging);
+        bool same = (scan->victims_hash == indexed->victims_hash && scan->num_selections == indexed->num_selections
+                && scan_cost == sim->cost);
+        all_same = all_same && same;
+        double scan_us = scan->selection_time * 1e6 / max(scan->num_selections, 1UL);
+        double indexed_us = indexed->selection_time * 1e6 / max(indexed->num_selections, 1UL);
+        printf("%10d %10lu %16.3f %16.3f %9.1fx %10s\n", num_frames, scan->num_selections, scan_us, indexed_us,
+                scan_us / indexed_us, same ? "same" : "DIFFER");
+        delete scan;
+        delete indexed;
+    }
+    return all_same ? 0 : 1;
+}
+
+// -bsimd : time per victim selection of the full scan AGING with each kernel version this CPU can run,
+// and check that they all pick the same victims as the scalar one
+int benchmark_simd() {
+    const long num_instructions = 20000; // after the frame table is full
+    vector<FrameKernels> kernels = available_frame_kernels();
+    FrameKernels best_kernels = frame_kernels;
+    bool all_same = true;
+    printf("simd benchmark : %ld accesses after filling the frame table, 4 pages per frame\n", num_instructions);
+    printf("%10s %10s %10s %12s %10s\n", "frames", "kernels", "faults", "us/fault", "victims");
+    for (int num_frames = 256; num_frames <= 65536; num_frames *= 16) {
+        unsigned long scalar_hash = 0;
+        for (size_t k = 0; k < kernels.size(); k++) {
+            frame_kernels = kernels[k];
+            RecordingPager* pager = run_synthetic(num_frames, num_instructions, make_aging_scan);
+            if (k == 0) {
+                scalar_hash = pager->victims_hash;
+            }
+            bool same = (pager->victims_hash == scalar_hash);
+            all_same = all_same && same;
+            printf("%10d %10s %10lu %12.3f %10s\n", num_frames, kernels[k].name, pager->num_selections,
+                    pager->selection_time * 1e6 / max(pager->num_selections, 1UL), same ? "same" : "DIFFER");
+            delete pager;
+        }
+    }
+    frame_kernels = best_kernels;
+    return all_same ? 0 : 1;
+}
+
+// Trace of the readahead check : one process reading a file mapped VMA of scan_pages pages in order, again and
+// again, with every other access going to a hot set of anonymous pages, written one time out of 4
+struct ScanInstructionReader: public InstructionReader {
+
+    int scan_pages;
+    int hot_pages;
+    long num_instructions;
+    int scan_position;
+    unsigned int seed;
+
+    ScanInstructionReader(int scan_pages_, int hot_pages_, long num_instructions_) {
+        scan_pages = scan_pages_;
+        hot_pages = hot_pages_;
+        num_instructions = num_instructions_;
+        scan_position = 0;
+        seed = 42;
+    }
+
+    unsigned int next_random() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    void read_processes() {
+        sim->NUM_PROCESSES = 1;
+        Process process = Process(0, 2);
+        process.add_vma(VMA(0, 0, scan_pages - 1, false, true));
+        process.add_vma(VMA(1, scan_pages, scan_pages + hot_pages - 1, false, false));
+        sim->processes.push_back(process);
+    }
+
+    bool next(Instruction& instr) {
+        if (count >= num_instructions) {
+            return false;
+        }
+        if (count == 0) {
+            instr = Instruction(count++, 'c', 0);
+            return true;
+        }
+        if (count % 2 == 1) {
+            instr = Instruction(count++, 'r', scan_position);
+            scan_position = (scan_position + 1) % scan_pages;
+            return true;
+        }
+        unsigned int r = next_random();
+        instr = Instruction(count++, (r & 0x30) ? 'r' : 'w', scan_pages + (int) ((r >> 8) % hot_pages));
+        return true;
+    }
+
+};
+
+// Every mapped frame is the one of the PTE it points to, and every valid PTE is in such a frame
+bool frame_table_consistent() {
+    int num_mapped = 0;
+    for (vector<Frame>::iterator it = sim->frameTable.begin(); it != sim->frameTable.end(); it++) {
+        if (it->isFree) {
+            continue;
+        }
+        num_mapped++;
+        PTE* pte = it->process->pageTable.find(it->vpage);
+        if (pte != it->get_pte() || pte == 0 || !pte->valid || (int) pte->physAddr != it->fid) {
+            return false;
+        }
+    }
+    int num_valid = 0;
+    for (vector<Process>::iterator it_proc = sim->processes.begin(); it_proc != sim->processes.end(); it_proc++) {
+        for (int vpage = 0; vpage < MAX_NUM_PTE; vpage++) {
+            PTE* pte = it_proc->pageTable.find(vpage);
+            if (pte != 0 && pte->valid) {
+                num_valid++;
+            }
+        }
+    }
+    return num_valid == num_mapped;
+}
+
+// Run the scan trace with num_frames frames, a readahead window of readahead_max and the pager built by
+// make_pager. ok is cleared if a batch took the frame of the page which started it or if the frame table
+// and the page tables disagree at the end
+RecordingPager* run_readahead_check(int num_frames, int readahead_max, const char* algorithm, bool& ok) {
+    int scan_pages = 8 * num_frames;
+    int hot_pages = num_frames;
+    reset_simulation(num_frames, scan_pages + hot_pages);
+    sim->READAHEAD_MAX = readahead_max;
+    ScanInstructionReader reader = ScanInstructionReader(scan_pages, hot_pages, 20000);
+    reader.read_processes();
+    istringstream rand_file ("7 3 1 4 1 5 9 2");
+    string name (algorithm);
+    Pager* pager;
+    if (name == "a_scan") {
+        pager = new AGING_SCAN();
+    } else if (name == "a_indexed") {
+        pager = new AGING();
+    } else {
+        string error;
+        pager = create_pager(algorithm, rand_file, TraceSource(0), error);
+    }
+    RecordingPager* recording = new RecordingPager(pager);
+    Simulator<Pager> simulator = Simulator<Pager>(recording, &reader);
+    Instruction instr;
+    while (simulator.get_next_instruction(instr)) {
+        sim->inst_count++;
+        simulator.execute(instr);
+        if (simulator.readahead_count > 0) {
+            Frame* trigger = simulator.readahead_trigger;
+            Process* trigger_process = trigger->process;
+            int trigger_vpage = trigger->vpage;
+            simulator.readahead();
+            ok = ok && trigger->process == trigger_process && trigger->vpage == trigger_vpage;
+        }
+    }
+    ok = ok && frame_table_consistent();
+    sim->READAHEAD_MAX = 0;
+    return recording;
+}
+
+// -breadahead : every algorithm but OPT on a scan of a file with readahead, with windows below and above the
+// number of frames. Checks that no batch evicts the page which started it, that the frame table stays right,
+// and that the full scan AGING and the indexed AGING pick the same victims with the prefetched pages
+int benchmark_readahead() {
+    const char* algos[] = {"f", "r", "c", "e", "a_scan", "a_indexed", "w", "lru", "lru_approx", "lfu", "arc", "car", "2q"};
+    const int num_algos = sizeof(algos) / sizeof(algos[0]);
+    const int configs[][2] = {{4, 8}, {32, 8}, {32, 64}}; // frames, readahead window
+    bool all_ok = true;
+    printf("readahead benchmark : 20000 accesses, half of them scanning a file of 8 pages per frame\n");
+    printf("%10s %7s %7s %10s %10s %10s %10s\n", "algorithm", "frames", "window", "cost", "prefetched", "hits", "check");
+    for (int c = 0; c < 3; c++) {
+        unsigned long aging_hash = 0;
+        unsigned long aging_cost = 0;
+        for (int a = 0; a < num_algos; a++) {
+            bool ok = true;
+            RecordingPager* pager = run_readahead_check(configs[c][0], configs[c][1], algos[a], ok);
+            // Both AGING must give the same victims
+            if (string(algos[a]) == "a_scan") {
+                aging_hash = pager->victims_hash;
+                aging_cost = sim->cost;
+            } else if (string(algos[a]) == "a_indexed") {
+                ok = ok && pager->victims_hash == aging_hash && sim->cost == aging_cost;
+            }
+            all_ok = all_ok && ok;
+            printf("%10s %7d %7d %10lu %10lu %10lu %10s\n", algos[a], configs[c][0], configs[c][1], sim->cost,
+                    sim->readahead_pages, sim->readahead_hits, ok ? "ok" : "BROKEN");
+            delete pager;
+        }
+    }
+    return all_ok ? 0 : 1;
+}
+
+// -breclaim : every algorithm but OPT on the scan trace with the reclaim daemon, from a daemon keeping a few
+// frames free to one freeing the whole frame table after every fault. With only a few frames mapped among
+// thousands, the pagers must still find their victims among them : checks that every run ends with the
+// frame table right
+int benchmark_reclaim() {
+    const char* algos[] = {"f", "r", "c", "e", "a", "w", "lru", "lru_approx", "lfu", "arc", "car", "2q"};
+    const int num_algos = sizeof(algos) / sizeof(algos[0]);
+    const int configs[][3] = {{32, 4, 8}, {32, 32, 32}, {4096, 4096, 4096}}; // frames, low and high watermarks
+    bool all_ok = true;
+    printf("reclaim benchmark : 20000 accesses, half of them scanning a file of 8 pages per frame\n");
+    printf("%10s %7s %7s %7s %10s %10s %10s %10s\n", "algorithm", "frames", "low", "high", "cost", "wakeups",
+            "reclaimed", "check");
+    for (int c = 0; c < 3; c++) {
+        for (int a = 0; a < num_algos; a++) {
+            int num_frames = configs[c][0];
+            reset_simulation(num_frames, 9 * num_frames);
+            sim->RECLAIM_LOW = configs[c][1];
+            sim->RECLAIM_HIGH = configs[c][2];
+            ScanInstructionReader reader = ScanInstructionReader(8 * num_frames, num_frames, 20000);
+            reader.read_processes();
+            istringstream rand_file ("7 3 1 4 1 5 9 2");
+            string error;
+            Pager* pager = create_pager(algos[a], rand_file, TraceSource(0), error);
+            Simulator<Pager> simulator = Simulator<Pager>(pager, &reader);
+            simulator.simulation();
+            bool ok = frame_table_consistent();
+            all_ok = all_ok && ok;
+            printf("%10s %7d %7d %7d %10lu %10lu %10lu %10s\n", algos[a], num_frames, configs[c][1], configs[c][2],
+                    sim->cost, sim->kswapd_wakeups, sim->pages_reclaimed, ok ? "ok" : "BROKEN");
+            delete pager;
+            sim->RECLAIM_LOW = 0;
+            sim->RECLAIM_HIGH = 0;
+        }
+    }
+    return all_ok ? 0 : 1;
+}
+
+// -bdispatch : instructions/sec of the generic simulator, calling the pager through virtual calls, against the
+// simulator specialized for the type of the pager. Every algorithm runs all the given traces with 16 and 32
+// frames like scripts/runit.sh, again and again for at least min_seconds. The traces are loaded in memory once
+// and only the simulation loops are timed
+int benchmark_dispatch(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("Please give the input files AND a random file to the benchmark\n");
+        return -1;
+    }
+    const double min_seconds = 0.5;
+    const char* algos[] = {"f", "r", "c", "e", "a", "w", "lru", "lru_approx", "lfu", "arc", "car", "2q"};
+    const int num_algos = sizeof(algos) / sizeof(algos[0]);
+    const int frame_counts[2] = {16, 32};
+
+    ifstream rand_file ( argv[argc - 1] );
+    if ( !rand_file.is_open() ) {
+        cout<< "Could not open the rand file \n";
+        return -1;
+    }
+    stringstream rand_content;
+    rand_content << rand_file.rdbuf();
+    int num_traces = argc - 1;
+    vector<MmuTrace> traces (num_traces);
+    for (int i = 0; i < num_traces; i++) {
+        string error;
+        if (!traces[i].load(argv[i], error)) {
+            cout<< error << "\n";
+            return -1;
+        }
+    }
 
-                    vector<PTE>* pageTable = &(curr_process->pageTable);
-                    for ( vector<PTE>::iterator it_pte = pageTable->begin(); it_pte != pageTable->end(); it_pte++ ) {
-                        // If page valid
-                        if (it_pte->valid) {
-                            int frameNumber = it_pte->physAddr;
-                            cost += COST_UNMAP;
-                            bool onExit = true;
-                            Frame* frame = &(frameTable[frameNumber]);
-                            frame->unmap(onExit);
-                            // Careful. If the frame is a dirty non-fmapped, we must add it to the free pool
-                            // We used the onExit flag to tell the unmap function to NOT put the dirty non-fmapped in the swap area
-                            // The unmap function set the toFreePool flag to tell us that the frame needs to be put in free pool
-                            // We use this complicated flag system because the free frame pool is not available in the unmap scope
-                            // So we have to do the manipulation here
-                            if (frame->toFreePool) {
-                                frameFreePool.push(*frame);
-                                frame->toFreePool = false;
-                            }
+    bool all_same = true;
+    Simulation* main_simulation = sim;
+    printf("dispatch benchmark on %d traces, 16 and 32 frames, at least %.1f s per algorithm and simulator\n",
+            num_traces, min_seconds);
+    printf("%12s %18s %18s %10s %10s\n", "algorithm", "virtual instr/sec", "typed instr/sec", "speedup", "costs");
+    for (int a = 0; a < num_algos; a++) {
+        double rates[2];
+        unsigned long costs[2];
+        for (int typed = 0; typed < 2; typed++) {
+            unsigned long num_instructions = 0;
+            double seconds = 0;
+            costs[typed] = 0;
+            for (int round = 0; seconds < min_seconds; round++) {
+                for (int t = 0; t < num_traces; t++) {
+                    for (int f = 0; f < 2; f++) {
+                        Simulation simulation (frame_counts[f], 0);
+                        sim = &simulation;
+                        reset_simulation_state();
+                        BinaryInstructionReader reader;
+                        reader.open_buffer(traces[t].data, traces[t].size);
+                        reader.check_header();
+                        reader.read_processes();
+                        istringstream random_numbers (rand_content.str());
+                        string error;
+                        Pager* pager = create_pager(algos[a], random_numbers,
+                                TraceSource(argv[t], traces[t].data, traces[t].size), error);
+                        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                        if (typed) {
+                            simulate(pager, &reader);
+                        } else {
+                            Simulator<Pager> simulator = Simulator<Pager>(pager, &reader);
+                            simulator.simulation();
                         }
-                        // If not valid, cancel the page from swap device
-                        else {
-                            it_pte->pagedout = 0;
+                        seconds += elapsed_seconds(start);
+                        num_instructions += simulation.inst_count;
+                        if (round == 0) {
+                            costs[typed] += simulation.cost;
                         }
+                        delete pager;
+                        sim = main_simulation;
                     }
+                }
+            }
+            rates[typed] = num_instructions / seconds;
+        }
+        bool same = (costs[0] == costs[1]);
+        all_same = all_same && same;
+        printf("%12s %18.0f %18.0f %9.2fx %10s\n", algos[a], rates[0], rates[1], rates[1] / rates[0],
+                same ? "same" : "DIFFER");
+    }
+    return all_same ? 0 : 1;
+}
 
-                    curr_process = 0;
-                } // end case 'e'
+// -bsmp : scaling of the SMP mode. Instructions/sec of the simulation of the input file with 1 (the simulator
+// of a single CPU), 2, 4 and 8 simulated CPUs, with the share of the instructions run without stopping the other
+// CPUs and the lock waits. The trace is loaded once and every run repeated for at least min_seconds
+int benchmark_smp(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("Please give an input file AND a random file to the benchmark\n");
+        return -1;
+    }
+    const double min_seconds = 0.5;
+    const char* algos[] = {"f", "c", "a", "lru"};
+    const int num_algos = sizeof(algos) / sizeof(algos[0]);
+    const int cpu_counts[] = {1, 2, 4, 8};
+    const int num_cpu_counts = sizeof(cpu_counts) / sizeof(cpu_counts[0]);
+
+    MmuTrace trace;
+    string error;
+    if (!trace.load(argv[0], error)) {
+        cout<< error << "\n";
+        return -1;
+    }
+    ifstream rand_file ( argv[1] );
+    if ( !rand_file.is_open() ) {
+        cout<< "Could not open the rand file \n";
+        return -1;
+    }
+    stringstream rand_content;
+    rand_content << rand_file.rdbuf();
+
+    printf("smp benchmark on %s, 64 frames, %u hardware threads\n", argv[0], thread::hardware_concurrency());
+    printf("%10s %5s %14s %9s %8s %10s\n", "algorithm", "cpus", "instr/sec", "speedup", "fast", "waits");
+    for (int a = 0; a < num_algos; a++) {
+        double single_cpu_rate = 0;
+        for (int c = 0; c < num_cpu_counts; c++) {
+            MmuConfig config;
+            config.num_frames = 64;
+            config.algorithm = algos[a];
+            config.random_numbers = rand_content.str();
+            config.num_cpus = cpu_counts[c];
+            MmuEngine engine = MmuEngine(config);
+            unsigned long num_instructions = 0, num_fast = 0, num_waits = 0;
+            double seconds = 0;
+            while (seconds < min_seconds) {
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                MmuResults results = engine.run(trace);
+                seconds += elapsed_seconds(start);
+                if (!results.ok) {
+                    printf("%s\n", results.error.c_str());
+                    return -1;
+                }
+                num_instructions += results.inst_count;
+                for (vector<MmuCpuResults>::iterator it_cpu = results.cpus.begin(); it_cpu != results.cpus.end(); it_cpu++) {
+                    num_fast += it_cpu->fast_accesses;
+                    num_waits += it_cpu->lock_waits;
+                }
+            }
+            double rate = num_instructions / seconds;
+            if (c == 0) {
+                single_cpu_rate = rate;
+            }
+            printf("%10s %5d %14.0f %8.2fx %7.1f%% %10lu\n", algos[a], cpu_counts[c], rate, rate / single_cpu_rate,
+                    100.0 * num_fast / num_instructions, num_waits);
+        }
+    }
+    return 0;
+}
 
-             } // end switch
+int run_benchmark(const char* name, int argc, char* argv[]) {
+    string name_str (name);
+    if (name_str == "pstats") {
+        return benchmark_pstats();
+    }
+    if (name_str == "aging") {
+        return benchmark_aging();
+    }
+    if (name_str == "simd") {
+        return benchmark_simd();
+    }
+    if (name_str == "readahead") {
+        return benchmark_readahead();
+    }
+    if (name_str == "reclaim") {
+        return benchmark_reclaim();
+    }
+    if (argc < 1) {
+        printf("Please give an input file to the benchmark\n");
+        return -1;
+    }
+    if (name_str == "parse") {
+        return benchmark_parse(argv[0]);
+    }
+    if (name_str == "dispatch") {
+        return benchmark_dispatch(argc, argv);
+    }
+    if (name_str == "smp") {
+        return benchmark_smp(argc, argv);
+    }
+    fprintf(stderr, "Unknown benchmark `%s'.\n", name);
+    return -1;
+}
 
-         }// end while
+int run_conversion(const char* out_path, int argc, char* argv[]) {
+    if (argc != 1) {
+        printf("Please give exactly 1 input file to convert\n");
+        return -1;
+    }
+    ifstream input_file ( argv[0] );
+    if ( !input_file.is_open() ) {
+        cout<< "Could not open the input file \n";
+        return -1;
+    }
+    InstructionReader* reader = open_instruction_reader(argv[0], input_file);
+    if (reader == 0) {
+        cout<< "Could not read the input file \n";
+        return -1;
+    }
+    FILE* out_file = fopen(out_path, "wb");
+    if (out_file == 0) {
+        cout<< "Could not open the output file \n";
+        return -1;
+    }
+    long num_instructions = convert_to_binary(reader, out_file);
+    long num_bytes = ftell(out_file);
+    fclose(out_file);
+    delete reader;
+    if (num_instructions < 0) {
+        remove(out_path);
+        return -1;
+    }
+    printf("Converted %ld instructions of %s into %s (%ld bytes)\n", num_instructions, argv[0], out_path, num_bytes);
+    return 0;
+}
 
-    } // end simulation 
 
-    void print_pagetables() {
+//-------------------- STEP 12 : Miss ratio curve --------------------
+// LRU is a stack algorithm : with c frames it keeps the c most recently used pages, so an access hits for
+// every c >= the depth of its page in the LRU stack. We compute the depth of every access in one pass
+// (Mattson's stack distances) and get the number of faults for every number of frames at once.
+// The stack is kept as the times of last access of the pages : the depth of a page is the number of pages
+// used since its last access, counted with a Fenwick tree over the access times. O(log n) per access.
+// When a process exits its frames are freed : its pages stay in the stack as holes. A hole above a page
+// is a free frame for the frame counts that page doesn't fit in, so the next access to a page below the
+// most recent hole uses it instead of pushing the stack down : the hole moves to the old place of the page
+
+// Fenwick tree of counts indexed by time, doubling its size when the times go past it
+struct FenwickTree {
+    vector<int> counts; // counts[t], to rebuild the tree when it grows
+    vector<int> tree; // tree[i] is the sum of counts on ]i - (i & -i), i], 1-based
+
+    void add(unsigned int t, int delta) {
+        if (t >= counts.size()) {
+            grow(t + 1);
+        }
+        counts[t] += delta;
+        for (unsigned int i = t + 1; i <= tree.size(); i += i & (-i)) {
+            tree[i - 1] += delta;
+        }
+    }
 
-        for (vector<Process>::iterator it_proc = processes.begin(); it_proc != processes.end(); it_proc++) {
-            printf("PT[%d]:", it_proc->pid);
-//            cout << "PT[" << it_proc->pid << "]:";
-            vector<PTE>* pageTable = &(it_proc->pageTable);
-            int incr = 0; // index the cirtual page in the page table
-            for ( vector<PTE>::iterator it_pte = pageTable->begin(); it_pte != pageTable->end(); it_pte++ ) {
-                // If not valid
-                if ( !it_pte->valid ) {
-                    // We check wrether or not it is paged out
-                    if (it_pte->pagedout) {
-                        printf(" #");
-//                        cout << " #";
-                   } else {
-                       printf(" *");
-//                        cout << " *";
-                   }
-                }
-                else {
-                    printf(" %d:", incr);
-//                    cout << " " << incr << ":";
-                    if (it_pte->referenced) {cout << "R";}
-                    else {
-                        printf("-");
-//                        cout << "-";
-                    }
+    // Sum of the counts on [0, t]
+    int prefix(unsigned int t) {
+        int sum = 0;
+        for (unsigned int i = min(t + 1, (unsigned int) tree.size()); i > 0; i -= i & (-i)) {
+            sum += tree[i - 1];
+        }
+        return sum;
+    }
 
-                    if (it_pte->modified) {
-                        printf("M");
-//                        cout << "M";
-                    }
-                    else {
-                        printf("-");
-//                        cout << "-";
-                    }
+    void grow(unsigned int min_size) {
+        unsigned int size = max((unsigned int) 1024, (unsigned int) counts.size());
+        while (size < min_size) {
+            size *= 2;
+        }
+        counts.resize(size, 0);
+        // Linear time construction : every node gives its sum to its parent
+        tree.assign(counts.begin(), counts.end());
+        for (unsigned int i = 1; i <= size; i++) {
+            unsigned int parent = i + (i & (-i));
+            if (parent <= size) {
+                tree[parent - 1] += tree[i - 1];
+            }
+        }
+    }
+};
 
-                    if (it_pte->pagedout) {
-                        printf("S");
-//                        cout << "S";
-                    }
-                    else {
-                        printf("-");
-//                       cout << "-";
-                    }
-                }
-                incr++;
+const unsigned int NEVER_ACCESSED = 0xffffffff;
 
+// mmu -m<max frames> inputfile : print "MRC <accesses> <pages>" then "<frames> <faults> <miss ratio>" for
+// 1 to max frames. With -m0 the curve stops at the depth where it becomes flat (only the first accesses fault)
+int run_miss_ratio_curve(const char* max_frames_value, int argc, char* argv[]) {
+    int max_frames = atoi(max_frames_value);
+    if (max_frames < 0 || max_frames > MAX_FRAMES_LIMIT) {
+        fprintf (stderr, "The number of frames of -m must be between 0 and %d.\n", MAX_FRAMES_LIMIT);
+        return -1;
+    }
+    if (argc != 1) {
+        printf("Please give exactly 1 input file\n");
+        return -1;
+    }
+    ifstream input_file ( argv[0] );
+    if ( !input_file.is_open() ) {
+        cout<< "Could not open the input file \n";
+        return -1;
+    }
+    InstructionReader* reader = open_instruction_reader(argv[0], input_file);
+    if (reader == 0) {
+        cout<< "Could not read the input file \n";
+        return -1;
+    }
+    reader->read_processes();
+
+    PageTimes last_access (NEVER_ACCESSED);
+    vector< vector<int> > used_pages (sim->processes.size()); // pages of each process in the stack
+    FenwickTree stack; // 1 at the last access time of every page and hole of the stack
+    set<unsigned int> holes; // times of the holes left by the exited processes
+    vector<unsigned long> depths; // depths[d] : number of accesses at depth d, first accesses at depth 0
+    unsigned long num_accesses = 0;
+    unsigned long num_pages = 0;
+    unsigned int time = 0;
+    Process* curr_process = 0;
+    Instruction instr;
+    while (reader->next(instr)) {
+        if (instr.command == 'c') {
+            curr_process = &sim->processes[instr.arg];
+            continue;
+        }
+        if (instr.command == 'e') {
+            vector<int>& pages = used_pages[curr_process->pid];
+            for (vector<int>::iterator it = pages.begin(); it != pages.end(); it++) {
+                unsigned int& last = last_access.at(curr_process->pid, *it);
+                holes.insert(last);
+                last = NEVER_ACCESSED;
             }
-            printf("\n");
-//            cout << endl; // end of printing one page table
+            pages.clear();
+            curr_process = 0;
+            continue;
+        }
+        // Only the accesses in a VMA use a frame
+        if ((instr.command != 'r' && instr.command != 'w') || !curr_process->isInVMA(instr.arg)) {
+            continue;
+        }
+        if (time == NEVER_ACCESSED) {
+            fprintf (stderr, "Too many accesses in the input file for -m.\n");
+            delete reader;
+            return -1;
+        }
+        unsigned int& last = last_access.at(curr_process->pid, instr.arg);
+        unsigned int depth = 0;
+        if (last == NEVER_ACCESSED) {
+            used_pages[curr_process->pid].push_back(instr.arg);
+            num_pages++;
+        } else {
+            depth = stack.prefix(time) - (last == 0 ? 0 : stack.prefix(last - 1));
         }
+        if (!holes.empty() && (last == NEVER_ACCESSED || *holes.rbegin() > last)) {
+            // The most recent hole is filled, the page leaves a hole at its old place
+            stack.add(*holes.rbegin(), -1);
+            holes.erase(--holes.end());
+            if (last != NEVER_ACCESSED) {
+                holes.insert(last);
+            }
+        } else if (last != NEVER_ACCESSED) {
+            stack.add(last, -1);
+        }
+        stack.add(time, 1);
+        last = time;
+        time++;
+        num_accesses++;
+        if (depth >= depths.size()) {
+            depths.resize(depth + 1, 0);
+        }
+        depths[depth]++;
+    }
+    delete reader;
 
+    if (max_frames == 0) {
+        max_frames = max((int) depths.size() - 1, 1);
     }
+    // An access faults with c frames if it's a first access or deeper than c
+    unsigned long faults = num_accesses;
+    char ratio[32];
+    sim->output.put("MRC "); sim->output.put(num_accesses);
+    sim->output.put(' '); sim->output.put(num_pages);
+    sim->output.put('\n');
+    for (int frames = 1; frames <= max_frames; frames++) {
+        if (frames < (int) depths.size()) {
+            faults -= depths[frames];
+        }
+        snprintf(ratio, sizeof(ratio), "%.6f", (num_accesses == 0) ? 0.0 : (double) faults / num_accesses);
+        sim->output.put(frames);
+        sim->output.put(' '); sim->output.put(faults);
+        sim->output.put(' '); sim->output.put(ratio);
+        sim->output.put('\n');
+    }
+    sim->output.flush();
+    return 0;
+}
 
-    void print_frametable() {
-        
-        printf("FT:");
-//        cout << "FT:";
-        for (vector<Frame>::iterator it_frame = frameTable.begin(); it_frame != frameTable.end(); it_frame++) {
-            if (it_frame->isFree) {
-                printf(" *");
-//                cout << " *";
-            } else {
-                printf(" %d:%d", it_frame->process->pid, it_frame->vpage);
-//                cout << " " << it_frame->process->pid << ":" << it_frame->vpage;
-            }
+
+//-------------------- STEP 13 : Parallel sweep --------------------
+// mmu -S<outdir> -f<frames>[,<frames>...] -a<algo>[,<algo>...] [-j<threads>] [-o<options>] inputfile... randomfile
+// runs every (input, algorithm, frames) configuration like "mmu -f<frames> -a<algo> -o<options> inputfile randomfile"
+// and writes its output in <outdir>/out<input>_<frames>_<algo>, the names of scripts/runit.sh (in1 gives out1_16_f).
+// Each input is converted once to a binary trace in memory, which all its simulations read without copying it.
+// The simulations are independent : each one is run by its own MmuEngine on one thread of a pool
+
+// One configuration of the sweep and what it gave
+struct SweepJob {
+    MmuTrace* trace;
+    string trace_name; // file name without directory and without the "in" prefix
+    MmuConfig config;
+    string out_path;
+    MmuResults results;
+};
+
+// Pool of threads running a fixed set of jobs. Every worker gets its share of the jobs in its own deque,
+// takes them from the back and, once its deque is empty, steals from the front of the deques of the others.
+// No job is added while the pool runs, so a worker stops when it finds all the deques empty
+struct WorkStealingPool {
+
+    struct WorkerQueue {
+        mutex lock;
+        deque<int> jobs;
+    };
+
+    vector<WorkerQueue*> queues;
+    void (*run_job)(int job, void* context);
+    void* context;
+
+    WorkStealingPool(int num_threads, int num_jobs, void (*run_job_)(int, void*), void* context_) {
+        run_job = run_job_;
+        context = context_;
+        for (int i = 0; i < num_threads; i++) {
+            queues.push_back(new WorkerQueue());
         }
-        printf("\n");
-//        cout << endl;
+        for (int job = 0; job < num_jobs; job++) {
+            queues[job % num_threads]->jobs.push_back(job);
+        }
+    }
 
+    ~WorkStealingPool() {
+        for (vector<WorkerQueue*>::iterator it = queues.begin(); it != queues.end(); it++) {
+            delete *it;
+        }
     }
 
-    void print_summary() {
+    // Next job of the worker, -1 when there is nothing left anywhere
+    int take_job(int worker) {
+        {
+            lock_guard<mutex> guard (queues[worker]->lock);
+            if (!queues[worker]->jobs.empty()) {
+                int job = queues[worker]->jobs.back();
+                queues[worker]->jobs.pop_back();
+                return job;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            WorkerQueue* victim = queues[(worker + i) % queues.size()];
+            lock_guard<mutex> guard (victim->lock);
+            if (!victim->jobs.empty()) {
+                int job = victim->jobs.front();
+                victim->jobs.pop_front();
+                return job;
+            }
+        }
+        return -1;
+    }
 
-        for (vector<Process>::iterator it_proc = processes.begin(); it_proc != processes.end(); it_proc++) {
-            printf("PROC[%d]: U=%lu M=%lu I=%lu O=%lu FI=%lu FO=%lu Z=%lu SV=%lu SP=%lu\n",
-                    it_proc->pid,
-                    it_proc->pstats["unmaps"], it_proc->pstats["maps"], it_proc->pstats["ins"], it_proc->pstats["outs"],
-                    it_proc->pstats["fins"], it_proc->pstats["fouts"], it_proc->pstats["zeros"],
-                    it_proc->pstats["segv"], it_proc->pstats["segprot"]
-                    );
+    void work(int worker) {
+        for (int job = take_job(worker); job != -1; job = take_job(worker)) {
+            run_job(job, context);
         }
+    }
 
+    // Run all the jobs and wait for them. The calling thread is the first worker
+    void run() {
+        vector<thread> threads;
+        for (size_t worker = 1; worker < queues.size(); worker++) {
+            threads.push_back(thread(&WorkStealingPool::work, this, (int) worker));
+        }
+        work(0);
+        for (vector<thread>::iterator it = threads.begin(); it != threads.end(); it++) {
+            it->join();
+        }
     }
 
-    void print_cost() {
+};
 
-        printf("TOTALCOST %lu %lu %lu %lu %lu\n",
-        inst_count, ctx_switches, process_exits, cost, sizeof(PTE));
-        
+// Run one configuration with its own engine, writing to its own file
+void run_sweep_job(int job_index, void* context) {
+    SweepJob& job = (*(vector<SweepJob>*) context)[job_index];
+    FILE* out_file = fopen(job.out_path.c_str(), "w");
+    if (out_file == 0) {
+        job.results.error = "Could not open the output file " + job.out_path;
+        return;
     }
+    job.config.output = out_file;
+    MmuEngine engine = MmuEngine(job.config);
+    job.results = engine.run(*job.trace);
+    fclose(out_file);
+}
 
-};
+// Split "a,b,c" into its items
+vector<string> split_list(const char* list) {
+    vector<string> items;
+    string item;
+    istringstream stream (list);
+    while (getline(stream, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// config has the options of the command line, the frames and the algorithm are set for each job
+int run_sweep(const char* out_dir, const char* frames_value, const char* algos_value, const char* threads_value,
+        const MmuConfig& config, int argc, char* argv[]) {
+    if (frames_value == NULL || algos_value == NULL) {
+        printf("Please give the frame counts with -f and the algorithms with -a\n");
+        return -1;
+    }
+    if (argc < 2) {
+        printf("Please give at least 1 input file AND a random file\n");
+        return -1;
+    }
+    vector<int> frame_counts;
+    vector<string> frames_list = split_list(frames_value);
+    for (vector<string>::iterator it = frames_list.begin(); it != frames_list.end(); it++) {
+        int num_frames = atoi(it->c_str());
+        if (num_frames < 1 || num_frames > MAX_FRAMES_LIMIT) {
+            fprintf (stderr, "The number of frames must be between 1 and %d.\n", MAX_FRAMES_LIMIT);
+            return -1;
+        }
+        if (config.reclaim_high > num_frames) {
+            fprintf (stderr, "Option -k expects <low>[:<high>] free frames with 0 < low <= high <= frames.\n");
+            return -1;
+        }
+        frame_counts.push_back(num_frames);
+    }
+    vector<string> algos = split_list(algos_value);
+    int num_threads = (threads_value != NULL) ? atoi(threads_value) : (int) thread::hardware_concurrency();
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+
+    ifstream rand_file ( argv[argc - 1] );
+    if ( !rand_file.is_open() ) {
+        cout<< "Could not open the rand file \n";
+        return -1;
+    }
+    stringstream rand_content;
+    rand_content << rand_file.rdbuf();
+
+    // Every input is parsed once, into a binary trace in memory
+    int num_traces = argc - 1;
+    vector<MmuTrace> traces (num_traces);
+    vector<SweepJob> jobs;
+    for (int i = 0; i < num_traces; i++) {
+        string error;
+        if (!traces[i].load(argv[i], error)) {
+            cout<< error << "\n";
+            return -1;
+        }
+        const char* base_name = strrchr(argv[i], '/');
+        string trace_name = (base_name == 0) ? argv[i] : base_name + 1;
+        if (trace_name.compare(0, 2, "in") == 0 && trace_name.size() > 2) {
+            trace_name = trace_name.substr(2);
+        }
+        for (vector<string>::iterator it_algo = algos.begin(); it_algo != algos.end(); it_algo++) {
+            for (vector<int>::iterator it_frames = frame_counts.begin(); it_frames != frame_counts.end(); it_frames++) {
+                SweepJob job;
+                job.trace = &traces[i];
+                job.trace_name = trace_name;
+                job.config = config;
+                job.config.num_frames = *it_frames;
+                job.config.algorithm = *it_algo;
+                job.config.random_numbers = rand_content.str();
+                job.out_path = string(out_dir) + "/out" + trace_name + "_" + to_string(*it_frames) + "_" + *it_algo;
+                jobs.push_back(job);
+            }
+        }
+    }
 
+    WorkStealingPool pool = WorkStealingPool(min(num_threads, max((int) jobs.size(), 1)), jobs.size(), run_sweep_job, &jobs);
+    pool.run();
 
+    // One line per configuration, in the order of scripts/runit.sh
+    int num_failed = 0;
+    for (vector<SweepJob>::iterator it = jobs.begin(); it != jobs.end(); it++) {
+        if (!it->results.ok) {
+            fprintf (stderr, "%s: %s\n", it->out_path.c_str(), it->results.error.c_str());
+            num_failed++;
+            continue;
+        }
+        printf("out%s_%d_%s: TOTALCOST %lu %lu %lu %lu %lu\n", it->trace_name.c_str(), it->config.num_frames,
+                it->config.algorithm.c_str(), it->results.inst_count, it->results.ctx_switches,
+                it->results.process_exits, it->results.cost, (unsigned long) sizeof(PTE));
+    }
+    return (num_failed == 0) ? 0 : -1;
+}
 
+} // end of the private part of the command line
 
 int main(int argc, char *argv[]) {
     bool fflag = false;
@@ -1021,12 +5928,26 @@ int main(int argc, char *argv[]) {
     char *fvalue = NULL;
     char *avalue = NULL;
     char *ovalue = NULL;
+    char *bvalue = NULL;
+    char *xvalue = NULL;
+    char *vvalue = NULL;
+    char *lvalue = NULL;
+    char *Tvalue = NULL;
+    char *tvalue = NULL;
+    char *mvalue = NULL;
+    char *Svalue = NULL;
+    char *jvalue = NULL;
+    char *pvalue = NULL;
+    char *svalue = NULL;
+    char *kvalue = NULL;
+    char *rvalue = NULL;
+    char *dvalue = NULL;
     int o;
 
     
     opterr = 0;
 
-    while ((o = getopt (argc, argv, "f:a:o:")) != -1)
+    while ((o = getopt (argc, argv, "f:a:o:b:x:v:l:T:t:m:S:j:p:s:k:r:d:")) != -1)
         switch (o)
         {
         case 'f':
@@ -1053,8 +5974,53 @@ int main(int argc, char *argv[]) {
             }
             ovalue = optarg;
             break;
+        case 'b':
+            bvalue = optarg;
+            break;
+        case 'x':
+            xvalue = optarg;
+            break;
+        case 'v':
+            vvalue = optarg;
+            break;
+        case 'l':
+            lvalue = optarg;
+            break;
+        case 'T':
+            Tvalue = optarg;
+            break;
+        case 't':
+            tvalue = optarg;
+            break;
+        case 'm':
+            mvalue = optarg;
+            break;
+        case 'S':
+            Svalue = optarg;
+            break;
+        case 'j':
+            jvalue = optarg;
+            break;
+        case 'p':
+            pvalue = optarg;
+            break;
+        case 's':
+            svalue = optarg;
+            break;
+        case 'k':
+            kvalue = optarg;
+            break;
+        case 'r':
+            rvalue = optarg;
+            break;
+        case 'd':
+            dvalue = optarg;
+            break;
         case '?':
-            if (optopt == 'f' || optopt == 'a' || optopt == 'o') {
+            if (optopt == 'f' || optopt == 'a' || optopt == 'o' || optopt == 'b' || optopt == 'x' || optopt == 'v'
+                    || optopt == 'l' || optopt == 'T' || optopt == 't' || optopt == 'm' || optopt == 'S' || optopt == 'j'
+                    || optopt == 'p' || optopt == 's' || optopt == 'k'
+                    || optopt == 'r' || optopt == 'd') {
                 fprintf (stderr, "Option -%c requires an argument.\n", optopt);
             }
             else if (isprint (optopt)) {
@@ -1070,9 +6036,142 @@ int main(int argc, char *argv[]) {
             abort ();
         }
 
-    MAX_NUM_FRAMES = stoi(fvalue); // set the frame table size
-    initFrameFreePool(MAX_NUM_FRAMES); // Initialize the empty frame table
-    initFrameTable(MAX_NUM_FRAMES);
+    // The simulation of the command line. The benchmarks, the conversion and the curve use it for their state
+    Simulation main_simulation (0, stdout);
+    sim = &main_simulation;
+
+    // Benchmarks don't run a simulation
+    if (bvalue != NULL) {
+        return run_benchmark(bvalue, argc - optind, argv + optind);
+    }
+
+    // Conversion of a text trace into a binary trace : mmu -x<binfile> inputfile
+    if (xvalue != NULL) {
+        return run_conversion(xvalue, argc - optind, argv + optind);
+    }
+
+    int num_vpages = MAX_NUM_PTE;
+    if (vvalue != NULL) {
+        num_vpages = stoi(vvalue); // set the size of the virtual address spaces
+        if (num_vpages < 1 || num_vpages > MAX_PTE_LIMIT) {
+            fprintf (stderr, "The number of virtual pages must be between 1 and %d.\n", MAX_PTE_LIMIT);
+            return -1;
+        }
+    }
+
+    // Miss ratio curve of LRU for all the numbers of frames : mmu -m<max frames> inputfile
+    if (mvalue != NULL) {
+        mmu_set_address_space(num_vpages, 0, 0, 0);
+        return run_miss_ratio_curve(mvalue, argc - optind, argv + optind);
+    }
+
+    // Everything else is given to the engine
+    MmuConfig config;
+    config.output = stdout;
+    if (tvalue != NULL) {
+        config.working_set_tau = stoi(tvalue); // set the working set window
+        if (config.working_set_tau < 0) {
+            fprintf (stderr, "The working set TAU must be >= 0.\n");
+            return -1;
+        }
+    }
+    // Page table geometry : -l<levels>[:<walk cost>[:<alloc cost>]] enables the radix page table costs
+    int levels = 0, walk_cost = COST_PT_WALK, alloc_cost = COST_PT_ALLOC;
+    if (lvalue != NULL) {
+        int num_fields = sscanf(lvalue, "%d:%d:%d", &levels, &walk_cost, &alloc_cost);
+        if (num_fields < 1 || levels < 1 || levels > PT_MAX_LEVELS || walk_cost < 0 || alloc_cost < 0) {
+            fprintf (stderr, "Option -l expects <levels>[:<walk cost>[:<alloc cost>]] with 1 to %d levels.\n", PT_MAX_LEVELS);
+            return -1;
+        }
+    }
+    if (!mmu_set_address_space(num_vpages, levels, walk_cost, alloc_cost)) {
+        fprintf (stderr, "Option -l expects <levels>[:<walk cost>[:<alloc cost>]] with %d to %d levels for %d pages.\n",
+                pagetable_min_levels(num_vpages), PT_MAX_LEVELS, num_vpages);
+        return -1;
+    }
+    // TLB : -T<entries>[:<ways>[:<lru|random>[:<asid|flush>]]]
+    if (Tvalue != NULL) {
+        int num_entries = 0, num_ways = 0;
+        char policy[16] = "lru", mode[16] = "flush";
+        int num_fields = sscanf(Tvalue, "%d:%d:%15[a-z]:%15[a-z]", &num_entries, &num_ways, policy, mode);
+        if (num_fields < 2) {
+            num_ways = num_entries; // fully associative
+        }
+        string policy_str (policy), mode_str (mode);
+        if (num_fields < 1 || num_entries < 1 || num_ways < 1 || num_entries % num_ways != 0
+                || (policy_str != "lru" && policy_str != "random") || (mode_str != "asid" && mode_str != "flush")) {
+            fprintf (stderr, "Option -T expects <entries>[:<ways>[:<lru|random>[:<asid|flush>]]] with entries a multiple of ways.\n");
+            return -1;
+        }
+        config.tlb_entries = num_entries;
+        config.tlb_ways = num_ways;
+        config.tlb_lru = (policy_str == "lru");
+        config.tlb_asid = (mode_str == "asid");
+    }
+    // Output options
+    if (ovalue != NULL) {
+        config.output_options = ovalue;
+    }
+    // Readahead : -r<max pages> prefetched after a sequential fault
+    if (rvalue != NULL) {
+        config.readahead_max = stoi(rvalue);
+        if (config.readahead_max < 0) {
+            fprintf (stderr, "Option -r expects a number of pages >= 0.\n");
+            return -1;
+        }
+    }
+    // Time model : -d<queue depth>[:<transfer time>] of the swap and file devices
+    if (dvalue != NULL) {
+        int num_fields = sscanf(dvalue, "%d:%d", &config.io_depth, &config.io_transfer);
+        if (num_fields < 1 || config.io_depth < 1 || config.io_transfer < 0) {
+            fprintf (stderr, "Option -d expects <queue depth>[:<transfer time>] with a depth >= 1.\n");
+            return -1;
+        }
+    }
+    // SMP mode : -s<cpus> simulated CPUs, each one on a thread
+    if (svalue != NULL) {
+        config.num_cpus = stoi(svalue);
+        if (config.num_cpus < 1) {
+            fprintf (stderr, "Option -s expects a number of CPUs >= 1.\n");
+            return -1;
+        }
+    }
+    // Pipelined mode : -p2 parses the trace on another thread, -p3 also writes the output on a third one
+    if (pvalue != NULL) {
+        config.pipeline_stages = stoi(pvalue);
+        if (config.pipeline_stages < 1 || config.pipeline_stages > 3) {
+            fprintf (stderr, "Option -p expects 1, 2 or 3 stages.\n");
+            return -1;
+        }
+    }
+
+    // Reclaim daemon : -k<low>[:<high>] free frames watermarks, high = low by default.
+    // high is checked against the frames once we know them, for each frame count of a sweep
+    if (kvalue != NULL) {
+        int num_fields = sscanf(kvalue, "%d:%d", &config.reclaim_low, &config.reclaim_high);
+        if (num_fields < 2) {
+            config.reclaim_high = config.reclaim_low;
+        }
+        if (num_fields < 1 || config.reclaim_low < 1 || config.reclaim_high < config.reclaim_low) {
+            fprintf (stderr, "Option -k expects <low>[:<high>] free frames with 0 < low <= high <= frames.\n");
+            return -1;
+        }
+    }
+
+    // Parallel sweep over inputs, algorithms and frame counts : mmu -S<outdir> -f<frames>,... -a<algo>,... inputfile... randomfile
+    if (Svalue != NULL) {
+        return run_sweep(Svalue, fvalue, avalue, jvalue, config, argc - optind, argv + optind);
+    }
+
+    config.num_frames = stoi(fvalue); // set the frame table size
+    if (config.num_frames < 1 || config.num_frames > MAX_FRAMES_LIMIT) {
+        fprintf (stderr, "The number of frames must be between 1 and %d.\n", MAX_FRAMES_LIMIT);
+        return -1;
+    }
+    if (config.reclaim_high > config.num_frames) {
+        fprintf (stderr, "Option -k expects <low>[:<high>] free frames with 0 < low <= high <= frames.\n");
+        return -1;
+    }
 
     if (argc - optind < 2 ) { 
         printf("Please give an input file AND a random file\n"); 
@@ -1095,56 +6194,20 @@ int main(int argc, char *argv[]) {
         cout<< "Could not open the rand file \n"; 
         return -1;
     }
-
-    // Process input file to initialize the processes, instructions etc
-    readInput(input_file);
-
-    // Define the pager
-    Pager* pager;
-    switch (avalue[0]) {
-
-        case 'f' : {
-            pager = new FIFO();
-            break;
-        }
-        case 'c' : {
-            pager = new CLOCK();
-            break;
-        }
-        case 'e' : {
-            pager = new EnhancedSecondChance();
-            break;
-        }
-        case 'a' : {
-            pager = new AGING();
-            break;
-        }
-        case 'w' : {
-            pager = new WORKING_SET();
-            break;
-        }
-        case 'r' : {
-            pager = new RANDOM(rand_file);
-            break;
-        }
-    }
-
-    Simulator simulator = Simulator(pager);
-    simulator.simulation();
-
-    string ovalue_str (ovalue);
-    if (ovalue_str.find('P') != string::npos) {
-        simulator.print_pagetables();
-    }
-    if (ovalue_str.find('F') != string::npos) {
-        simulator.print_frametable();
-    }
-    if (ovalue_str.find('S') != string::npos) {
-        simulator.print_summary();
-        simulator.print_cost();
+    stringstream rand_content;
+    rand_content << rand_file.rdbuf();
+    config.random_numbers = rand_content.str();
+    config.algorithm = avalue;
+
+    // The instructions are streamed from the input file during the simulation
+    MmuEngine engine = MmuEngine(config);
+    MmuResults results = engine.run(argv[optind]);
+    if (!results.ok) {
+        fprintf (stderr, "%s\n", results.error.c_str());
+        return -1;
     }
 
-
     return 0;
 
-}
\ No newline at end of file
+}
+#endif
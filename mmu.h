@@ -0,0 +1,222 @@
+#ifndef MMU_H
+#define MMU_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Simulation engine of mmu, usable as a library (libmmu.a). Every MmuEngine::run is a complete simulation
+// with its own frames, processes, counters and output : runs don't share any state, so a program can do
+// thousands of them, one after the other or at the same time on different threads.
+// The size of the address spaces and the page table geometry are the only settings of the whole process :
+// 64 pages and the default page table unless mmu_set_address_space() is called before the runs
+
+// Cost of each operation of the simulation. The defaults are the ones of mmu
+struct MmuCostTable {
+    int read;
+    int write;
+    int ctx_switch;
+    int exit;
+    int map;
+    int unmap;
+    int in;
+    int out;
+    int fin;
+    int fout;
+    int zero;
+    int segv;
+    int segprot;
+    int prefetch; // read of a page by a readahead batch, in place of its FIN or IN
+
+    MmuCostTable() {
+        read = 1;
+        write = 1;
+        ctx_switch = 130;
+        exit = 1250;
+        map = 300;
+        unmap = 400;
+        in = 3100;
+        out = 2700;
+        fin = 2800;
+        fout = 2400;
+        zero = 140;
+        segv = 340;
+        segprot = 420;
+        prefetch = 400;
+    }
+};
+
+// Everything a run needs to know, the options of the mmu command line
+struct MmuConfig {
+    int num_frames; // -f
+    std::string algorithm; // -a : f, r, c, e, a, w or one of lru, lru_approx, lfu, arc, car, 2q, opt
+    std::string random_numbers; // content of the random file, only read by the r algorithm
+    MmuCostTable costs;
+    FILE* output; // where the trace and the tables are written, 0 to write nothing
+    std::string output_options; // -o : O (trace), P (page tables), F (frame table), S (summary), R (OPT ratio)
+    int tlb_entries; // -T : 0 for no TLB
+    int tlb_ways; // 0 for a fully associative TLB
+    bool tlb_lru; // LRU replacement in the TLB sets, random otherwise
+    bool tlb_asid; // entries tagged with the pid, flush on context switch otherwise
+    int working_set_tau; // -t
+    int reclaim_low; // -k : free frames watermarks of the reclaim daemon, 0 without daemon
+    int reclaim_high;
+    int readahead_max; // -r : biggest readahead window in pages, 0 without readahead
+    int io_depth; // -d : time model with swap and file devices of that queue depth, 0 without time model
+    int io_transfer; // time to transfer a page on a device, after the latency of the request (its cost)
+    int num_cpus; // -s : simulated CPUs, each one on a thread of its own when more than 1
+    int pipeline_stages; // -p : 1 runs on the calling thread, 2 parses the trace on a thread of its own,
+                         // 3 also writes the output on a third one
+
+    MmuConfig() {
+        num_frames = 16;
+        output = 0;
+        tlb_entries = 0;
+        tlb_ways = 0;
+        tlb_lru = true;
+        tlb_asid = false;
+        working_set_tau = 49;
+        reclaim_low = 0;
+        reclaim_high = 0;
+        readahead_max = 0;
+        io_depth = 0;
+        io_transfer = 200;
+        num_cpus = 1;
+        pipeline_stages = 1;
+    }
+};
+
+// A trace parsed once and kept in memory in the binary trace format (see mmu -x). Runs only read it,
+// so any number of them can use the same trace at the same time
+struct MmuTrace {
+    std::string path; // the input file, for the messages
+    char* data;
+    size_t size;
+
+    MmuTrace() {
+        data = 0;
+        size = 0;
+    }
+    ~MmuTrace();
+
+    // Read and convert a text or binary trace. Returns false and sets error if it can't be read
+    bool load(const char* path, std::string& error);
+
+    private:
+        MmuTrace(const MmuTrace&);
+        MmuTrace& operator=(const MmuTrace&);
+};
+
+// Per process statistics, as in the PROC lines of the summary
+struct MmuProcessResults {
+    unsigned long unmaps;
+    unsigned long maps;
+    unsigned long ins;
+    unsigned long outs;
+    unsigned long fins;
+    unsigned long fouts;
+    unsigned long zeros;
+    unsigned long segv;
+    unsigned long segprot;
+};
+
+// Per CPU statistics of the SMP mode, as in the CPU lines of the summary
+struct MmuCpuResults {
+    unsigned long inst_count;
+    unsigned long ctx_switches;
+    unsigned long cost;
+    unsigned long fast_accesses; // reads and writes done while the other CPUs kept running
+    unsigned long locked_ops; // instructions done with all the CPUs stopped (faults, pager hooks, exits ...)
+    unsigned long lock_waits; // lock acquisitions which had to wait for another CPU
+    unsigned long remote_unmaps; // pages of processes of other CPUs evicted by the faults of this one
+
+    MmuCpuResults() {
+        inst_count = ctx_switches = cost = 0;
+        fast_accesses = locked_ops = lock_waits = remote_unmaps = 0;
+    }
+};
+
+// Requests on a device of the time model, as in the IO lines of the summary
+struct MmuDeviceResults {
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long busy_time; // time with at least one request in service
+    unsigned long wait_time; // sum of the times the requests waited for a slot of the queue
+
+    MmuDeviceResults() {
+        reads = writes = busy_time = wait_time = 0;
+    }
+};
+
+struct MmuResults {
+    bool ok; // false if the run couldn't be done, error tells why
+    std::string error;
+    // TOTALCOST line
+    unsigned long inst_count;
+    unsigned long ctx_switches;
+    unsigned long process_exits;
+    unsigned long cost;
+    // TLB line, 0 without TLB
+    unsigned long tlb_hits;
+    unsigned long tlb_misses;
+    unsigned long tlb_flushes;
+    unsigned long tlb_invalidations;
+    // PTCOST line
+    unsigned long pt_walks;
+    unsigned long pt_walk_reads;
+    unsigned long pt_tables;
+    std::vector<MmuProcessResults> processes;
+    std::vector<MmuCpuResults> cpus; // SMP mode only
+    // KSWAPD line, reclaim daemon only. direct_reclaims is also counted without daemon
+    unsigned long kswapd_wakeups;
+    unsigned long pages_reclaimed;
+    unsigned long direct_reclaims; // evictions done by the faults themselves
+    unsigned long reclaim_cost; // cost of the daemon, not in cost
+    // READAHEAD line, readahead only
+    unsigned long readahead_batches;
+    unsigned long readahead_pages; // pages prefetched
+    unsigned long readahead_hits; // prefetched pages accessed
+    unsigned long readahead_wasted; // prefetched pages unmapped without being accessed
+    // TIME, FAULTLAT and IO lines, time model only
+    unsigned long total_time;
+    unsigned long cpu_time;
+    unsigned long idle_time; // time the CPU waited for blocked processes
+    unsigned long faults;
+    unsigned long fault_latency_p50;
+    unsigned long fault_latency_p90;
+    unsigned long fault_latency_p99;
+    unsigned long fault_latency_max;
+    MmuDeviceResults swap;
+    MmuDeviceResults file;
+
+    MmuResults() {
+        ok = false;
+        inst_count = ctx_switches = process_exits = cost = 0;
+        tlb_hits = tlb_misses = tlb_flushes = tlb_invalidations = 0;
+        pt_walks = pt_walk_reads = pt_tables = 0;
+        kswapd_wakeups = pages_reclaimed = direct_reclaims = reclaim_cost = 0;
+        readahead_batches = readahead_pages = readahead_hits = readahead_wasted = 0;
+        total_time = cpu_time = idle_time = 0;
+        faults = fault_latency_p50 = fault_latency_p90 = fault_latency_p99 = fault_latency_max = 0;
+    }
+};
+
+class MmuEngine {
+    public:
+        MmuConfig config;
+
+        MmuEngine(const MmuConfig& config_) : config(config_) {}
+
+        // Simulate a trace file, streamed from the disk
+        MmuResults run(const char* input_path);
+        // Simulate a trace already loaded
+        MmuResults run(const MmuTrace& trace);
+};
+
+// Size of the virtual address spaces (-v) and page table levels (-l) with the costs of a walk and of a table
+// allocation. levels = 0 keeps the default table without cost
+// (2 levels, more above 2^20 pages). Returns false if a value is invalid.
+// Must not be called while runs are going on
+bool mmu_set_address_space(int num_vpages, int levels, int walk_cost, int alloc_cost);
+
+#endif